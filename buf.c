@@ -29,6 +29,24 @@
 
 #define READ_BLOCK_SIZE BUFSIZ
 #define INIT_BUF_SIZE   512
+#define INIT_NUM_FRAMES 16
+/* Shorter text is copied onto the ibuf memory instead of making a frame */
+#define IBUF_FRAME_MIN 64
+/* Streams are read this much at a time, except for a terminal */
+#define IBUF_BLOCK_SIZE (1 << 16)
+
+/*
+ * get_ch, with the common cases inline: a character in the reversed buffer
+ * when no frame is pending, and one in the read block that does not change
+ * the row number. input is evaluated more than once.
+ */
+#define fast_get_ch(input, ch)                                                \
+    ((*(input))->fr_i ? get_ch(input, ch)                                     \
+        : (*(input))->i ? (*(ch) = *((*(input))->a + --(*(input))->i), 0)     \
+        : (*(input))->rb_i != (*(input))->rb_len && !(*(input))->incr_rn      \
+            && *((*(input))->rb + (*(input))->rb_i) != '\n'                   \
+        ? (*(ch) = *((*(input))->rb + (*(input))->rb_i++), 0)                 \
+        : get_ch(input, ch))
 
 /* ###################################################################### */
 
@@ -65,6 +83,12 @@ int free_ibuf(struct ibuf *b)
             if (fclose(b->fp))
                 ret = 1; /* Continue */
 
+        while (b->fr_i) free(b->fr[--b->fr_i].own);
+
+        free(b->rb);
+
+        free(b->fr);
+        free(b->spare);
         free(b->a);
         free(b);
         b = t;
@@ -102,8 +126,61 @@ static int grow_ibuf(struct ibuf *b, size_t will_use)
     return 0;
 }
 
+static int push_frame(
+    struct ibuf *b, const char *mem, size_t len, char *own, size_t own_n)
+{
+    struct ibuf_frame *f;
+    size_t new_n;
+
+    if (b->fr_i == b->fr_n) {
+        if (mof(b->fr_n, 2 * sizeof(*f), SIZE_MAX))
+            mreturn(1);
+
+        new_n = b->fr_n ? b->fr_n * 2 : INIT_NUM_FRAMES;
+        if ((f = realloc(b->fr, new_n * sizeof(*f))) == NULL)
+            mreturn(1);
+
+        b->fr = f;
+        b->fr_n = new_n;
+    }
+
+    f = b->fr + b->fr_i++;
+    f->start = mem;
+    f->p = mem;
+    f->stop = mem + len;
+    f->own = own;
+    f->own_n = own_n;
+    f->base = b->i;
+    return 0;
+}
+
+static void pop_frame(struct ibuf *b)
+{
+    /* Keeps the larger of the spare and the frame's memory for reuse */
+    struct ibuf_frame *f = b->fr + --b->fr_i;
+
+    if (f->own != NULL && f->own_n > b->spare_n) {
+        free(b->spare);
+        b->spare = f->own;
+        b->spare_n = f->own_n;
+    } else {
+        free(f->own);
+    }
+}
+
 int unget_ch(struct ibuf *b, char ch)
 {
+    struct ibuf_frame *f;
+
+    if (b->fr_i) {
+        f = b->fr + b->fr_i - 1;
+        if (b->i == f->base && f->p != f->start && *(f->p - 1) == ch) {
+            /* Put back the character that was just read from the frame */
+            --f->p;
+            return 0;
+        }
+    }
+
     if (b->i == b->n && grow_ibuf(b, 1))
         mreturn(1);
 
@@ -137,25 +214,110 @@ int unget_str(struct ibuf *b, const char *str)
     return 0;
 }
 
-int unget_stream(struct ibuf **b, FILE *fp, const char *nm)
+int unget_own(struct ibuf *b, char *mem, size_t len)
 {
     /*
-     * Creates a new struct head. *b can be NULL.
-     * Upon error, fp is closed by caller.
+     * Pushes back len characters of mem, taking ownership of mem, which
+     * must have come from malloc. Upon error, mem is freed by the caller.
+     */
+    if (!len) {
+        free(mem);
+        return 0;
+    }
+
+    if (push_frame(b, mem, len, mem, 0))
+        mreturn(1);
+
+    return 0;
+}
+
+int unget_obuf(struct ibuf *b, struct obuf *t)
+{
+    /*
+     * Pushes back the string in t, the same as unget_str would. Longer
+     * strings are not copied. Instead, t's memory is handed over to a frame,
+     * and t is given other memory. t is left empty.
+     */
+    size_t len = strlen(t->a);
+    char *m;
+    size_t m_n;
+
+    if (len < IBUF_FRAME_MIN) {
+        if (unget_str(b, t->a))
+            mreturn(1);
+
+        t->i = 0;
+        return 0;
+    }
+
+    if (b->spare != NULL) {
+        m = b->spare;
+        m_n = b->spare_n;
+    } else {
+        if ((m = malloc(INIT_BUF_SIZE)) == NULL)
+            mreturn(1);
+
+        m_n = INIT_BUF_SIZE;
+    }
+
+    if (push_frame(b, t->a, len, t->a, t->n)) {
+        if (m != b->spare)
+            free(m);
+
+        mreturn(1);
+    }
+
+    if (m == b->spare) {
+        b->spare = NULL;
+        b->spare_n = 0;
+    }
+
+    t->a = m;
+    t->n = m_n;
+    t->i = 0;
+    return 0;
+}
+
+static struct ibuf *init_stream_ibuf(FILE *fp, const char *nm)
+{
+    /*
+     * Only a regular file is read a block at a time. Other streams, such as
+     * a terminal or a pipe, are read a character at a time, so that input
+     * can be acted upon as soon as it arrives.
      */
     struct ibuf *t = NULL;
+    int is_reg = 0;
 
     if ((t = init_ibuf(INIT_BUF_SIZE)) == NULL)
-        mreturn(1);
+        mreturn(NULL);
 
     if ((t->nm = strdup(nm)) == NULL) {
         free_ibuf(t);
-        mreturn(1);
+        mreturn(NULL);
+    }
+
+    if (reg_file_check(fp, &is_reg)) {
+        free_ibuf(t);
+        mreturn(NULL);
     }
 
-    /* Success */
     t->fp = fp;
     t->rn = 1;
+    t->block = is_reg;
+
+    return t;
+}
+
+int unget_stream(struct ibuf **b, FILE *fp, const char *nm)
+{
+    /*
+     * Creates a new struct head. *b can be NULL.
+     * Upon error, fp is closed by caller.
+     */
+    struct ibuf *t = NULL;
+
+    if ((t = init_stream_ibuf(fp, nm)) == NULL)
+        mreturn(1);
 
     /* Link in front */
     t->next = *b;
@@ -184,18 +346,9 @@ int append_stream(struct ibuf **b, FILE *fp, const char *nm)
     struct ibuf *t = NULL;
     struct ibuf *w = NULL;
 
-    if ((t = init_ibuf(INIT_BUF_SIZE)) == NULL)
+    if ((t = init_stream_ibuf(fp, nm)) == NULL)
         mreturn(1);
 
-    if ((t->nm = strdup(nm)) == NULL) {
-        free_ibuf(t);
-        mreturn(1);
-    }
-
-    /* Success */
-    t->fp = fp;
-    t->rn = 1;
-
     /* Link at end */
     if (*b != NULL) {
         w = *b;
@@ -226,17 +379,49 @@ int append_file(struct ibuf **b, const char *fn)
 int get_ch(struct ibuf **input, char *ch)
 {
     struct ibuf *t = NULL;
+    struct ibuf_frame *f;
+    size_t n;
     int x;
 
 top:
+    if ((*input)->fr_i
+        && (*input)->i
+            == (f = (*input)->fr + (*input)->fr_i - 1)->base) {
+        *ch = *f->p++;
+        if (f->p == f->stop)
+            pop_frame(*input);
+
+        return 0;
+    }
+
     if ((*input)->i) {
         --(*input)->i;
         *ch = *((*input)->a + (*input)->i);
         return 0;
     }
 
+    if ((*input)->rb_i != (*input)->rb_len) {
+        x = (unsigned char) *((*input)->rb + (*input)->rb_i++);
+        goto got_ch;
+    }
+
     if ((*input)->fp != NULL) {
-        if ((x = getc((*input)->fp)) == EOF) {
+        if ((*input)->block) {
+            if ((*input)->rb == NULL
+                && ((*input)->rb = malloc(IBUF_BLOCK_SIZE)) == NULL)
+                mreturn(1);
+
+            if ((n = fread((*input)->rb, 1, IBUF_BLOCK_SIZE, (*input)->fp))) {
+                (*input)->rb_i = 0;
+                (*input)->rb_len = n;
+                goto top;
+            }
+            x = EOF;
+        } else {
+            x = getc((*input)->fp);
+        }
+
+        if (x == EOF) {
             if (ferror((*input)->fp))
                 mreturn(1);
             else if (feof((*input)->fp)) {
@@ -265,20 +450,130 @@ top:
                 }
             }
         } else {
-            if ((*input)->incr_rn) {
-                ++(*input)->rn;
-                (*input)->incr_rn = 0;
+            goto got_ch;
+        }
+    }
+
+    return EOF;
+
+got_ch:
+    /* Character from the stream */
+    if ((*input)->incr_rn) {
+        ++(*input)->rn;
+        (*input)->incr_rn = 0;
+    }
+
+    if (x == '\n')
+        (*input)->incr_rn = 1;
+
+    *ch = x;
+    return 0;
+}
+
+int peek_ch(struct ibuf **input, char *ch)
+{
+    /*
+     * Gives the next character without consuming it. Returns 0, EOF, or 1.
+     * When the row number would change, the character is read and put back,
+     * so that the row number is the one for the character.
+     */
+    struct ibuf *b = *input;
+    struct ibuf_frame *f;
+    int r;
+
+    if (b->fr_i && b->i == (f = b->fr + b->fr_i - 1)->base) {
+        *ch = *f->p;
+        return 0;
+    }
+
+    if (b->i) {
+        *ch = *(b->a + b->i - 1);
+        return 0;
+    }
+
+    if (b->rb_i != b->rb_len && !b->incr_rn) {
+        *ch = *(b->rb + b->rb_i);
+        return 0;
+    }
+
+    if ((r = get_ch(input, ch)))
+        return r;
+
+    if (unget_ch(*input, *ch))
+        mreturn(1);
+
+    return 0;
+}
+
+int get_run(struct ibuf *b, const struct byte_set *stop, struct obuf *out,
+    size_t *len)
+{
+    /*
+     * Moves the characters at the front of the input onto the end of out,
+     * stopping before the first one in stop. Only what is already in memory
+     * at the front is moved (one frame, the reversed buffer, or the read
+     * block), so the run can be short. len is set to the number moved.
+     */
+    struct ibuf_frame *f;
+    const char *q;
+    char t[INIT_BUF_SIZE];
+    size_t j, k, lo, nl = 0;
+
+    *len = 0;
+
+    if (b->fr_i && b->i == (f = b->fr + b->fr_i - 1)->base) {
+        q = scan_byte_set(stop, f->p, f->stop);
+        if (put_mem(out, f->p, q - f->p))
+            mreturn(1);
+
+        *len = q - f->p;
+        f->p = q;
+        if (f->p == f->stop)
+            pop_frame(b);
+
+        return 0;
+    }
+
+    if (b->i) {
+        /* Reversed, so copied a piece at a time, down to the top frame */
+        lo = b->fr_i ? (b->fr + b->fr_i - 1)->base : 0;
+        j = b->i;
+        do {
+            for (k = 0; k < INIT_BUF_SIZE && j > lo; ++k) {
+                if (stop->in[(unsigned char) *(b->a + j - 1)])
+                    break;
+
+                t[k] = *(b->a + --j);
             }
+            if (put_mem(out, t, k))
+                mreturn(1);
+        } while (k == INIT_BUF_SIZE);
 
-            if (x == '\n')
-                (*input)->incr_rn = 1;
+        *len = b->i - j;
+        b->i = j;
+        return 0;
+    }
 
-            *ch = x;
+    if (b->rb_i != b->rb_len) {
+        q = scan_byte_set(stop, b->rb + b->rb_i, b->rb + b->rb_len);
+        *len = q - (b->rb + b->rb_i);
+        if (!*len)
             return 0;
-        }
+
+        if (put_mem(out, b->rb + b->rb_i, *len))
+            mreturn(1);
+
+        /* Row number, as if read one at a time */
+        for (j = b->rb_i; j < b->rb_i + *len - 1; ++j)
+            if (*(b->rb + j) == '\n')
+                ++nl;
+
+        b->rn += b->incr_rn + nl;
+        b->incr_rn = *(q - 1) == '\n';
+        b->rb_i += *len;
     }
 
-    return EOF;
+    return 0;
 }
 
 int eat_whitespace(struct ibuf **input)
@@ -287,7 +582,7 @@ int eat_whitespace(struct ibuf **input)
     char ch;
 
     while (1) {
-        r = get_ch(input, &ch);
+        r = fast_get_ch(input, &ch);
         if (r == 1)
             mreturn(1);
         else if (r == EOF)
@@ -310,7 +605,7 @@ int delete_to_nl(struct ibuf **input)
     char ch;
 
     while (1) {
-        r = get_ch(input, &ch);
+        r = fast_get_ch(input, &ch);
         if (r == 1)
             mreturn(1);
         else if (r == EOF)
@@ -343,7 +638,7 @@ int eat_str_if_match(struct ibuf **input, const char *str)
         if (x == '\0')
             break;
 
-        r = get_ch(input, &ch);
+        r = fast_get_ch(input, &ch);
         if (r == 1)
             mreturn(1);
         else if (r == EOF)
@@ -381,7 +676,7 @@ int get_word(struct ibuf **input, struct obuf *token, int interpret_hex)
 
     token->i = 0;
 
-    if ((r = get_ch(input, &ch)))
+    if ((r = fast_get_ch(input, &ch)))
         return r;
 
     if (put_ch(token, ch))
@@ -396,7 +691,7 @@ int get_word(struct ibuf **input, struct obuf *token, int interpret_hex)
 
     second_ch = 1;
     while (1) {
-        r = get_ch(input, &ch);
+        r = fast_get_ch(input, &ch);
         if (r == 1)
             mreturn(1);
         else if (r == EOF) /* Ignore, as not the first char */
@@ -41,6 +41,8 @@ cc=clang
 flags='-ansi -g -Og -Wno-variadic-macros -Wall -Wextra -pedantic'
 # Change to N to use ncurses
 use_built_in_curses=Y
+# Change to Y to run the regex benchmark
+run_regex_bench=N
 #################
 
 
@@ -136,19 +138,22 @@ done < "$tmp"
 
 ld -r gen.o num.o buf.o gb.o eval.o ht.o toco_regex.o fs.o -o toucanlib.o
 
+libs='-lpthread'
 
-"$cc" $flags -o m4 m4.o toucanlib.o
-"$cc" $flags -o bc bc.o toucanlib.o
-"$cc" $flags -o freq freq.o toucanlib.o
+"$cc" $flags -o m4 m4.o toucanlib.o $libs
+"$cc" $flags -o bc bc.o toucanlib.o $libs
+"$cc" $flags -o freq freq.o toucanlib.o $libs
+"$cc" $flags -o regex_bench regex_bench.o toucanlib.o $libs
+"$cc" $flags -o regex_gen regex_gen.o toucanlib.o $libs
 
 
 if [ "$use_built_in_curses" = Y ]
 then
-    "$cc" $flags -o spot spot.o curses.o toucanlib.o
-    "$cc" $flags -o tornado_dodge tornado_dodge.o curses.o toucanlib.o
+    "$cc" $flags -o spot spot.o curses.o toucanlib.o $libs
+    "$cc" $flags -o tornado_dodge tornado_dodge.o curses.o toucanlib.o $libs
 else
-    "$cc" $flags -o spot spot.o toucanlib.o -lncurses
-    "$cc" $flags -o tornado_dodge tornado_dodge.o toucanlib.o -lncurses
+    "$cc" $flags -o spot spot.o toucanlib.o -lncurses $libs
+    "$cc" $flags -o tornado_dodge tornado_dodge.o toucanlib.o -lncurses $libs
 fi
 
 ldd spot tornado_dodge
@@ -161,5 +166,10 @@ m4 test.m4 > .k
 /usr/bin/m4 test.m4 > .k2
 cmp .k .k2
 
+if [ "$run_regex_bench" = Y ]
+then
+    ./regex_bench
+fi
+
 # Update files
 find . -type f \( -name '*.h' -o -name '*.c' \) -exec cp -p '{}' "$repo_dir" \;
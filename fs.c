@@ -57,6 +57,23 @@ int get_file_size(const char *fn, size_t *fs)
     return 0;
 }
 
+int reg_file_check(FILE *stream, int *is_reg)
+{
+    /* Sets is_reg if the stream is a regular file (not a terminal or pipe) */
+    struct stat_s st;
+    int fd;
+
+    if ((fd = fileno(stream)) == -1)
+        mreturn(1);
+
+    if (fstat_f(fd, &st) == -1)
+        mreturn(1);
+
+    *is_reg = S_ISREG(st.st_mode);
+
+    return 0;
+}
+
 int get_path_attr(const char *path, unsigned char *attr)
 {
     unsigned char t = '\0';
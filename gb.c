@@ -705,57 +705,137 @@ int swap_cursor_and_mark(struct gb *b)
     return 0;
 }
 
-int exact_forward_search(struct gb *b, struct gb *cl)
+static size_t count_nl(const unsigned char *p, size_t n)
 {
-    /* Moves cursor to the start of the match */
-    const unsigned char *q;
-    size_t num;
+    const unsigned char *q, *stop = p + n;
+    size_t count = 0;
 
-    start_of_gb(cl);
+    while ((q = memchr(p, '\n', stop - p)) != NULL) {
+        ++count;
+        p = q + 1;
+    }
 
-    if (b->c == b->e)
-        return 1;
+    return count;
+}
 
-    if ((q = quick_search(
-             b->a + b->c + 1, b->e - (b->c + 1), cl->a + cl->c, cl->e - cl->c))
-        == NULL)
+int set_cursor(struct gb *b, size_t x)
+{
+    /*
+     * Moves the cursor to offset x in the text (the gap is not counted),
+     * by relocating the gap once, instead of one char at a time.
+     */
+    size_t n, i, count;
+    unsigned char ch;
+
+    if (x > b->g + (b->e - b->c))
         return 1;
 
-    num = q - (b->a + b->c);
-    while (num--) right_ch(b);
+    b->sc_set = 0;
+
+    if (x < b->g) {
+        n = b->g - x;
+        b->r -= count_nl(b->a + x, n);
+        memmove(b->a + b->c - n, b->a + x, n);
+        /* Move mark across gap */
+        if (b->m_set && b->m >= x && b->m < b->g)
+            b->m += b->c - b->g;
+
+        b->g -= n;
+        b->c -= n;
+    } else if (x > b->g) {
+        n = x - b->g;
+        b->r += count_nl(b->a + b->c, n);
+        memmove(b->a + b->g, b->a + b->c, n);
+        /* Move mark across gap */
+        if (b->m_set && b->m >= b->c && b->m < b->c + n)
+            b->m -= b->c - b->g;
+
+        b->g += n;
+        b->c += n;
+    } else {
+        return 0;
+    }
+
+    /* Work out col */
+    i = b->g;
+    count = 1;
+    while (i) {
+        --i;
+        ch = *(b->a + i);
+        if (ch == '\n')
+            break;
+        else if (ch == '\t')
+            count += TAB_SIZE;
+        else
+            ++count;
+    }
+    b->col = count;
 
     return 0;
 }
 
-int regex_forward_search(struct gb *b, struct gb *cl, int case_ins)
+int exact_forward_search(struct gb *b, struct gb *cl)
 {
-    /* Moves cursor to after the match */
-    size_t match_offset, match_len, move;
+    /* Moves cursor to the start of the match. Wraps around. */
+    size_t from, offset;
 
     start_of_gb(cl);
 
-    if (b->c == b->e)
+    from = b->c == b->e ? b->g : b->g + 1;
+
+    if (quick_search_split(b->a, b->g, b->a + b->c, b->e - b->c, cl->a + cl->c,
+            cl->e - cl->c, from, 1, &offset))
+        return 1;
+
+    return set_cursor(b, offset);
+}
+
+int regex_forward_search(struct gb *b, struct regex *reg)
+{
+    /* Moves cursor to after the match. Wraps around. */
+    size_t from, match_offset, match_len;
+
+    from = b->c == b->e ? b->g : b->g + 1;
+
+    if (regex_exec_split(reg, (char *) b->a, b->g, (char *) b->a + b->c,
+            b->e - b->c, 1, from, 1, &match_offset, &match_len, 0))
         return 1;
 
-    if (regex_search((char *) b->a + b->c + 1, b->e - (b->c + 1),
-            *(b->a + b->c) == '\n' ? 1 : 0, (char *) cl->a + cl->c, 0,
-            case_ins, &match_offset, &match_len, 0))
+    return set_cursor(b, match_offset + match_len);
+}
+
+int exact_backward_search(struct gb *b, struct gb *cl)
+{
+    /* Moves cursor to the start of the previous match. Wraps around. */
+    size_t offset;
+
+    start_of_gb(cl);
+
+    if (quick_search_backward(b->a, b->g, b->a + b->c, b->e - b->c,
+            cl->a + cl->c, cl->e - cl->c, b->g, 1, &offset))
         return 1;
 
-    move = 1 + match_offset + match_len;
-    while (move) {
-        right_ch(b);
-        --move;
-    }
+    return set_cursor(b, offset);
+}
 
-    return 0;
+int regex_backward_search(struct gb *b, struct regex *reg)
+{
+    /* Moves cursor to the start of the previous match. Wraps around. */
+    size_t match_offset, match_len;
+
+    if (regex_exec_backward(reg, (char *) b->a, b->g, (char *) b->a + b->c,
+            b->e - b->c, 1, b->g, 1, &match_offset, &match_len, 0))
+        return 1;
+
+    return set_cursor(b, match_offset);
 }
 
 int regex_replace_region(struct gb *b, struct gb *cl, int case_ins)
 {
-    int ret = 1;
-    char delim, *find, *sep, *replace, *res = NULL;
-    size_t res_len, count;
+    int ret = 1, r;
+    char delim, *find, *sep, *replace;
+    size_t count;
+    struct obuf *res = NULL;
 
     START_GROUP;
 
@@ -781,22 +861,32 @@ int regex_replace_region(struct gb *b, struct gb *cl, int case_ins)
         if (swap_cursor_and_mark(b))
             mgoto(clean_up);
 
-    if (regex_replace((char *) b->a + b->c, b->m - b->c, find, 0, case_ins,
-            replace, &res, &res_len, 0))
+    count = b->m - b->c;
+    if (count == SIZE_MAX || (res = init_obuf(count + 1)) == NULL)
+        mgoto(clean_up);
+
+    if ((r = regex_replace_to((char *) b->a + b->c, count, find, 0, case_ins,
+             replace, res, 0))
+        == NO_MATCH) {
+        /* Leave the region untouched */
+        ret = 0;
+        goto clean_up;
+    }
+
+    if (r)
         mgoto(clean_up);
 
     /* Delete region */
-    count = b->m - b->c;
     while (count--)
         if (delete_ch(b))
             mgoto(clean_up);
 
-    if (insert_mem(b, res, res_len))
+    if (insert_mem(b, res->a, res->i))
         mgoto(clean_up);
 
     ret = 0;
 clean_up:
-    free(res);
+    free_obuf(res);
 
     END_GROUP;
 
@@ -29,6 +29,9 @@
 
 #define INIT_CONCAT_BUF 512
 
+/* No literal or state. See struct multi_lit. */
+#define ML_NONE SIZE_MAX
+
 int binary_io(void)
 {
 #ifdef _WIN32
@@ -84,12 +87,253 @@ char *concat(const char *str, ...)
     return res;
 }
 
+#if defined(USE_SSE2) || defined(USE_AVX2)
+#define USE_SIMD
+
+static unsigned int first_bit(unsigned int m)
+{
+    /* Index of the lowest set bit. m must be non-zero. */
+#if defined(__GNUC__)
+    return (unsigned int) __builtin_ctz(m);
+#elif defined(_MSC_VER)
+    unsigned long i;
+
+    _BitScanForward(&i, m);
+    return (unsigned int) i;
+#else
+    unsigned int i = 0;
+
+    while (!(m & 1)) {
+        m >>= 1;
+        ++i;
+    }
+    return i;
+#endif
+}
+#endif
+
+#ifdef USE_AVX2
+static int have_avx2(void)
+{
+    /* Checked once, as the answer cannot change */
+    static int avx2 = -1;
+
+    if (avx2 == -1) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") != 0;
+    }
+
+    return avx2;
+}
+
+__attribute__((target("avx2"))) static const unsigned char *scan_avx2(
+    const struct byte_set *s, const unsigned char *p,
+    const unsigned char *p_stop)
+{
+    /*
+     * Returns the first member, or where fewer than 32 bytes remain.
+     * Small sets compare against each member. Larger ones look up the low
+     * nibble of each byte, which gives the high nibbles that go with it.
+     */
+    __m256i v, r, c[BYTE_SET_LIST_MAX], lo, hi, bit, low3, top, zero;
+    unsigned int m;
+    size_t j;
+
+    if (s->num <= BYTE_SET_LIST_MAX) {
+        for (j = 0; j < BYTE_SET_LIST_MAX; ++j)
+            c[j] = _mm256_set1_epi8((char) s->list[j < s->num ? j : 0]);
+
+        for (; p_stop - p >= 32; p += 32) {
+            v = _mm256_loadu_si256((const __m256i *) p);
+            r = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c[0]),
+                                    _mm256_cmpeq_epi8(v, c[1])),
+                _mm256_or_si256(
+                    _mm256_cmpeq_epi8(v, c[2]), _mm256_cmpeq_epi8(v, c[3])));
+            if ((m = (unsigned int) _mm256_movemask_epi8(r)))
+                return p + first_bit(m);
+        }
+        return p;
+    }
+
+    lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) s->lo));
+    hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) s->hi));
+    bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0,
+        0, 1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    low3 = _mm256_set1_epi8(7);
+    top = _mm256_set1_epi8(-128);
+    zero = _mm256_setzero_si256();
+
+    for (; p_stop - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *) p);
+        /* A shuffle gives zero where the index has its top bit set */
+        r = _mm256_or_si256(_mm256_shuffle_epi8(lo, v),
+            _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, top)));
+        r = _mm256_and_si256(r,
+            _mm256_shuffle_epi8(
+                bit, _mm256_and_si256(_mm256_srli_epi16(v, 4), low3)));
+        m = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(r, zero));
+        if (m)
+            return p + first_bit(m);
+    }
+
+    return p;
+}
+
+__attribute__((target("avx2"))) static const unsigned char *pair_avx2(
+    const unsigned char **p, const unsigned char *p_last,
+    const unsigned char *find, size_t find_len)
+{
+    /*
+     * Tries 32 positions at a time, comparing in full only those where the
+     * first and last bytes of find both match. Returns the match, or NULL
+     * with p moved to where fewer than 32 positions remain.
+     */
+    __m256i a, b;
+    const unsigned char *q = *p;
+    unsigned int m, i;
+
+    a = _mm256_set1_epi8((char) find[0]);
+    b = _mm256_set1_epi8((char) find[find_len - 1]);
+
+    for (; q <= p_last && p_last - q >= 31; q += 32) {
+        m = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) q), a),
+            _mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *) (q + find_len - 1)),
+                b)));
+        while (m) {
+            i = first_bit(m);
+            if (!memcmp(q + i + 1, find + 1, find_len - 2))
+                return q + i;
+
+            m &= m - 1;
+        }
+    }
+
+    *p = q;
+    return NULL;
+}
+#endif
+
+#ifdef USE_SSE2
+static const unsigned char *scan_sse2(const struct byte_set *s,
+    const unsigned char *p, const unsigned char *p_stop)
+{
+    /* SSE2 version of scan_avx2, for small sets only */
+    __m128i v, r, c[BYTE_SET_LIST_MAX];
+    unsigned int m;
+    size_t j;
+
+    if (s->num > BYTE_SET_LIST_MAX)
+        return p;
+
+    for (j = 0; j < BYTE_SET_LIST_MAX; ++j)
+        c[j] = _mm_set1_epi8((char) s->list[j < s->num ? j : 0]);
+
+    for (; p_stop - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+        r = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, c[0]), _mm_cmpeq_epi8(v, c[1])),
+            _mm_or_si128(_mm_cmpeq_epi8(v, c[2]), _mm_cmpeq_epi8(v, c[3])));
+        if ((m = (unsigned int) _mm_movemask_epi8(r)))
+            return p + first_bit(m);
+    }
+
+    return p;
+}
+
+static const unsigned char *pair_sse2(const unsigned char **p,
+    const unsigned char *p_last, const unsigned char *find, size_t find_len)
+{
+    /* SSE2 version of pair_avx2 */
+    __m128i a, b;
+    const unsigned char *q = *p;
+    unsigned int m, i;
+
+    a = _mm_set1_epi8((char) find[0]);
+    b = _mm_set1_epi8((char) find[find_len - 1]);
+
+    for (; q <= p_last && p_last - q >= 15; q += 16) {
+        m = (unsigned int) _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) q), a),
+            _mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *) (q + find_len - 1)), b)));
+        while (m) {
+            i = first_bit(m);
+            if (!memcmp(q + i + 1, find + 1, find_len - 2))
+                return q + i;
+
+            m &= m - 1;
+        }
+    }
+
+    *p = q;
+    return NULL;
+}
+#endif
+
+void init_byte_set(struct byte_set *s)
+{
+    /* Fills in the rest of the set from s->in */
+    size_t j;
+
+    s->num = 0;
+    memset(s->lo, '\0', sizeof(s->lo));
+    memset(s->hi, '\0', sizeof(s->hi));
+
+    for (j = 0; j <= UCHAR_MAX; ++j) {
+        if (s->in[j]) {
+            if (s->num < BYTE_SET_LIST_MAX)
+                s->list[s->num] = (unsigned char) j;
+
+            ++s->num;
+
+            if (j < 0x80)
+                s->lo[j & 0x0F] |= 1 << (j >> 4);
+            else
+                s->hi[j & 0x0F] |= 1 << ((j >> 4) & 7);
+        }
+    }
+}
+
+const char *scan_byte_set(
+    const struct byte_set *s, const char *p, const char *p_stop)
+{
+    /*
+     * Returns the first byte in p up to p_stop that is in the set, or
+     * p_stop if there is none. Uses vector instructions where available,
+     * finishing off byte by byte.
+     */
+    const unsigned char *q = (const unsigned char *) p;
+    const unsigned char *q_stop = (const unsigned char *) p_stop;
+
+    if (s->num == 1) {
+        q = memchr(p, *s->list, p_stop - p);
+        return q == NULL ? p_stop : (const char *) q;
+    }
+
+#ifdef USE_AVX2
+    if (have_avx2())
+        q = scan_avx2(s, q, q_stop);
+#endif
+
+#ifdef USE_SSE2
+    q = scan_sse2(s, q, q_stop);
+#endif
+
+    while (q != q_stop && !s->in[*q]) ++q;
+
+    return (const char *) q;
+}
+
 void *quick_search(
     const void *mem, size_t mem_len, const void *find, size_t find_len)
 {
     /*
      * Sunday's Quick Search algoritm.
      * Exact match.
+     * Where vector instructions are available, the text is scanned for the
+     * first and last bytes of find together instead, see pair_avx2.
      */
     size_t b[UCHAR_MAX + 1];
     unsigned char *p, *p_last, *x, *q, *q_stop;
@@ -98,6 +342,34 @@ void *quick_search(
     if (find_len > mem_len)
         return NULL;
 
+    p = (unsigned char *) mem;
+    p_last = p + mem_len - find_len; /* Inclusive */
+
+#ifdef USE_SIMD
+    if (find_len >= 2) {
+        q = (unsigned char *) find;
+#ifdef USE_AVX2
+        if (have_avx2()
+            && (x = (unsigned char *) pair_avx2(
+                    (const unsigned char **) &p, p_last, q, find_len))
+                != NULL)
+            return x;
+#endif
+#ifdef USE_SSE2
+        if ((x = (unsigned char *) pair_sse2(
+                 (const unsigned char **) &p, p_last, q, find_len))
+            != NULL)
+            return x;
+#endif
+        /* Fewer positions remain than a vector holds */
+        for (; p <= p_last; ++p)
+            if (*p == *q && !memcmp(p + 1, q + 1, find_len - 1))
+                return p;
+
+        return NULL;
+    }
+#endif
+
     for (i = 0; i < UCHAR_MAX + 1; ++i) b[i] = find_len + 1;
 
     q = (unsigned char *) find;
@@ -105,9 +377,6 @@ void *quick_search(
 
     for (i = 0; i < find_len; ++i) b[q[i]] = find_len - i;
 
-    p = (unsigned char *) mem;
-    p_last = p + mem_len - find_len; /* Inclusive */
-
     while (p <= p_last) {
         x = p;
         q = (unsigned char *) find;
@@ -119,11 +388,308 @@ void *quick_search(
                 break;
         }
 
+        if (p == p_last)
+            break;
+
         p += b[p[find_len]];
     }
     return NULL;
 }
 
+static int quick_search_from(const unsigned char *mem0, size_t len0,
+    const unsigned char *mem1, size_t len1, const unsigned char *find,
+    size_t find_len, size_t from, size_t *offset)
+{
+    /* First match that commences at or after from */
+    const unsigned char *q;
+    size_t i, n;
+
+    if (from < len0) {
+        if ((q = quick_search(mem0 + from, len0 - from, find, find_len))
+            != NULL) {
+            *offset = q - mem0;
+            return 0;
+        }
+
+        /* Matches that span the two */
+        i = len0 - from < find_len ? from : len0 - find_len + 1;
+        for (; i < len0; ++i) {
+            n = len0 - i; /* Part in mem0 */
+            if (find_len - n <= len1 && !memcmp(mem0 + i, find, n)
+                && !memcmp(mem1, find + n, find_len - n)) {
+                *offset = i;
+                return 0;
+            }
+        }
+
+        from = len0;
+    }
+
+    if (from - len0 > len1)
+        return 1;
+
+    if ((q = quick_search(
+             mem1 + (from - len0), len1 - (from - len0), find, find_len))
+        == NULL)
+        return 1;
+
+    *offset = len0 + (q - mem1);
+    return 0;
+}
+
+int quick_search_split(const void *mem0, size_t len0, const void *mem1,
+    size_t len1, const void *find, size_t find_len, size_t from, int wrap,
+    size_t *offset)
+{
+    /*
+     * Exact search of the text formed by mem0 followed by mem1, such as the
+     * two sides of a gap buffer, without joining them. Commences at offset
+     * from, and if wrap is set, wraps around to the start of the text.
+     * The offset of the match is relative to the start of mem0.
+     * Returns 0 on a match.
+     */
+    if (from > len0 + len1)
+        return 1;
+
+    if (!quick_search_from(mem0, len0, mem1, len1, find, find_len, from,
+            offset))
+        return 0;
+
+    if (!wrap || !from)
+        return 1;
+
+    return quick_search_from(
+        mem0, len0, mem1, len1, find, find_len, 0, offset);
+}
+
+static int quick_rsearch_from(const unsigned char *mem0, size_t len0,
+    const unsigned char *mem1, const unsigned char *find, size_t find_len,
+    size_t from, size_t *offset)
+{
+    /* Closest match that commences before from, and ends at or before it */
+    size_t i, n;
+
+    if (!from || find_len > from)
+        return 1;
+
+    i = find_len ? from - find_len + 1 : from;
+    while (i--) {
+        if (i < len0) {
+            n = len0 - i < find_len ? len0 - i : find_len; /* Part in mem0 */
+            if (!memcmp(mem0 + i, find, n)
+                && !memcmp(mem1, find + n, find_len - n)) {
+                *offset = i;
+                return 0;
+            }
+        } else if (!memcmp(mem1 + (i - len0), find, find_len)) {
+            *offset = i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int quick_search_backward(const void *mem0, size_t len0, const void *mem1,
+    size_t len1, const void *find, size_t find_len, size_t from, int wrap,
+    size_t *offset)
+{
+    /*
+     * Backwards version of quick_search_split. Finds the match that commences
+     * closest before offset from, and ends at or before it. If wrap is set,
+     * and there is none, wraps around to the end of the text.
+     */
+    if (from > len0 + len1)
+        return 1;
+
+    if (!quick_rsearch_from(mem0, len0, mem1, find, find_len, from, offset))
+        return 0;
+
+    if (!wrap || from == len0 + len1)
+        return 1;
+
+    return quick_rsearch_from(
+        mem0, len0, mem1, find, find_len, len0 + len1, offset);
+}
+
+struct multi_lit {
+    size_t class_of[UCHAR_MAX + 1]; /* Byte class, 0 if in no literal */
+    size_t class_num;
+    size_t state_num;
+    size_t *trans; /* Next state, indexed by state * class_num + class */
+    size_t *depth; /* Length of the prefix that the state stands for */
+    size_t *lit;   /* Literal that the state completes, or ML_NONE */
+    size_t *out;   /* State with the longest literal that ends here */
+    struct byte_set first; /* Bytes that the literals commence with */
+};
+
+int multi_lit_compile(const char **lit, const size_t *lit_len, size_t num,
+    struct multi_lit **ml)
+{
+    /*
+     * Aho-Corasick automaton. A trie of the literals is made, then the
+     * failure links are found breadth first and used to fill in every
+     * missing transition, so that searching is one lookup per byte.
+     */
+    struct multi_lit *m;
+    size_t *fail = NULL, *queue = NULL;
+    size_t total = 1, cn, i, j, s, c, t, head, tail, *n;
+    const unsigned char *p;
+
+    if ((m = calloc(1, sizeof(struct multi_lit))) == NULL)
+        mreturn(1);
+
+    for (i = 0; i < num; ++i) {
+        if (!lit_len[i])
+            d_mgoto(error, "Empty literal\n");
+
+        if (aof(total, lit_len[i], SIZE_MAX))
+            mgoto(error);
+
+        total += lit_len[i];
+        p = (const unsigned char *) lit[i];
+        m->first.in[*p] = 1;
+        for (j = 0; j < lit_len[i]; ++j) m->class_of[p[j]] = 1;
+    }
+    init_byte_set(&m->first);
+
+    /* Each byte that is used gets its own class */
+    cn = 1;
+    for (j = 0; j <= UCHAR_MAX; ++j)
+        if (m->class_of[j])
+            m->class_of[j] = cn++;
+
+    m->class_num = cn;
+
+    if (mof(total, cn * sizeof(size_t), SIZE_MAX))
+        mgoto(error);
+
+    if ((m->trans = calloc(total * cn, sizeof(size_t))) == NULL
+        || (m->depth = malloc(total * sizeof(size_t))) == NULL
+        || (m->lit = malloc(total * sizeof(size_t))) == NULL
+        || (m->out = malloc(total * sizeof(size_t))) == NULL
+        || (fail = malloc(total * sizeof(size_t))) == NULL
+        || (queue = malloc(total * sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    /* Trie. No transition leads back to the root, so 0 means none yet. */
+    m->depth[0] = 0;
+    m->lit[0] = ML_NONE;
+    m->state_num = 1;
+    for (i = 0; i < num; ++i) {
+        p = (const unsigned char *) lit[i];
+        s = 0;
+        for (j = 0; j < lit_len[i]; ++j) {
+            n = m->trans + s * cn + m->class_of[p[j]];
+            if (!*n) {
+                *n = m->state_num++;
+                m->depth[*n] = m->depth[s] + 1;
+                m->lit[*n] = ML_NONE;
+            }
+            s = *n;
+        }
+        if (m->lit[s] == ML_NONE)
+            m->lit[s] = i; /* The first of any duplicates */
+    }
+
+    /* Failure links. A state's link is always processed before it is. */
+    fail[0] = 0;
+    m->out[0] = ML_NONE;
+    queue[0] = 0;
+    head = 0;
+    tail = 1;
+    while (head != tail) {
+        s = queue[head++];
+        for (c = 0; c < cn; ++c) {
+            n = m->trans + s * cn + c;
+            if (*n) {
+                t = *n;
+                fail[t] = s ? m->trans[fail[s] * cn + c] : 0;
+                m->out[t] = m->lit[t] != ML_NONE ? t : m->out[fail[t]];
+                queue[tail++] = t;
+            } else if (s) {
+                *n = m->trans[fail[s] * cn + c];
+            }
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    if (m->state_num != total
+        && (n = realloc(m->trans, m->state_num * cn * sizeof(size_t)))
+            != NULL)
+        m->trans = n;
+
+    *ml = m;
+    return 0;
+
+error:
+    free(fail);
+    free(queue);
+    multi_lit_free(m);
+    return 1;
+}
+
+int multi_lit_search(const struct multi_lit *m, const char *text,
+    size_t size, size_t *match_offset, size_t *match_len, size_t *lit_index)
+{
+    /*
+     * Finds the leftmost match of any of the literals, taking the longest
+     * when several commence at the same place. One pass is made over the
+     * text, no matter how many literals there are. Returns 0 or NO_MATCH.
+     */
+    const unsigned char *p = (const unsigned char *) text;
+    const unsigned char *p_stop = p + size;
+    size_t s = 0, x, end, best = ML_NONE, best_len = 0, best_lit = 0;
+
+    while (p != p_stop) {
+        if (!s) {
+            /* Nothing in progress, so skip to where a literal could start */
+            p = (const unsigned char *) scan_byte_set(
+                &m->first, (const char *) p, (const char *) p_stop);
+            if (p == p_stop)
+                break;
+        }
+        s = m->trans[s * m->class_num + m->class_of[*p++]];
+        end = p - (const unsigned char *) text;
+
+        /* Shorter literals that end here commence after this one */
+        if ((x = m->out[s]) != ML_NONE
+            && (best == ML_NONE || end - m->depth[x] < best
+                || (end - m->depth[x] == best && m->depth[x] > best_len))) {
+            best = end - m->depth[x];
+            best_len = m->depth[x];
+            best_lit = m->lit[x];
+        }
+
+        /* Later matches cannot commence before the current prefix */
+        if (best != ML_NONE && end - m->depth[s] > best)
+            break;
+    }
+
+    if (best == ML_NONE)
+        return NO_MATCH;
+
+    *match_offset = best;
+    *match_len = best_len;
+    if (lit_index != NULL)
+        *lit_index = best_lit;
+
+    return 0;
+}
+
+void multi_lit_free(struct multi_lit *m)
+{
+    if (m != NULL) {
+        free(m->trans);
+        free(m->depth);
+        free(m->lit);
+        free(m->out);
+        free(m);
+    }
+}
+
 FILE *fopen_w(const char *fn, int append)
 {
     /* Creates missing directories and opens a file for writing */
@@ -207,6 +773,48 @@ int milli_sleep(long milliseconds)
 #endif
 }
 
+size_t num_cpus(void)
+{
+    /* Number of online processors, or 1 if unknown */
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors ? si.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (size_t) n : 1;
+#else
+    return 1;
+#endif
+}
+
+int peak_mem(size_t *bytes)
+{
+    /* Peak resident memory of the process so far */
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 1;
+
+    *bytes = pmc.PeakWorkingSetSize;
+#else
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru))
+        return 1;
+
+#ifdef __APPLE__
+    *bytes = ru.ru_maxrss;
+#else
+    *bytes = (size_t) ru.ru_maxrss * 1024; /* Kilobytes */
+#endif
+#endif
+    return 0;
+}
+
 int random_uint(unsigned int *x)
 {
 #ifdef _WIN32
@@ -52,22 +52,35 @@ static void free_entry(struct entry *e)
 
 struct ht *init_ht(size_t num_buckets)
 {
+    /*
+     * num_buckets is rounded up to a power of two. It is the starting size
+     * and the table will not shrink below it.
+     */
     struct ht *ht;
+    size_t n = 1;
+
+    while (n < num_buckets) {
+        if (n > SIZE_MAX / 2)
+            mreturn(NULL);
+
+        n *= 2;
+    }
 
     if ((ht = calloc(1, sizeof(struct ht))) == NULL)
         mreturn(NULL);
 
-    if (mof(num_buckets, sizeof(struct entry *), SIZE_MAX)) {
+    if (mof(n, sizeof(struct entry *), SIZE_MAX)) {
         free(ht);
         mreturn(NULL);
     }
 
-    if ((ht->b = calloc(num_buckets, sizeof(struct entry *))) == NULL) {
+    if ((ht->b = calloc(n, sizeof(struct entry *))) == NULL) {
         free(ht);
         mreturn(NULL);
     }
 
-    ht->n = num_buckets;
+    ht->n = n;
+    ht->min_n = n;
 
     return ht;
 }
@@ -93,9 +106,9 @@ void free_ht(struct ht *ht)
     }
 }
 
-static size_t hash_func(const char *str, size_t n)
+static size_t hash_func(const char *str)
 {
-    /* djb2 */
+    /* djb2. The full hash is kept in the entry, the bucket is masked off. */
     unsigned char ch;
     size_t h = 5381;
 
@@ -103,19 +116,96 @@ static size_t hash_func(const char *str, size_t n)
         h = h * 33 ^ ch;
         ++str;
     }
-    return h % n; /* Bucket index */
+    return h;
 }
 
-struct entry *lookup(struct ht *ht, const char *name)
+static int grow_ht(struct ht *ht)
+{
+    /*
+     * Doubles the number of buckets. Each chain is split in place by the
+     * next bit of the cached hashes, so no names are rehashed.
+     */
+    struct entry **t, *e, *e_next, *lo, *hi, *lo_tail, *hi_tail;
+    size_t i;
+
+    if (mof(ht->n, 2 * sizeof(struct entry *), SIZE_MAX))
+        mreturn(1);
+
+    if ((t = realloc(ht->b, ht->n * 2 * sizeof(struct entry *))) == NULL)
+        mreturn(1);
+
+    ht->b = t;
+
+    for (i = 0; i < ht->n; ++i) {
+        lo = hi = lo_tail = hi_tail = NULL;
+        e = ht->b[i];
+        while (e != NULL) {
+            e_next = e->next;
+            if (e->h & ht->n) {
+                e->prev = hi_tail;
+                if (hi_tail == NULL)
+                    hi = e;
+                else
+                    hi_tail->next = e;
+
+                hi_tail = e;
+            } else {
+                e->prev = lo_tail;
+                if (lo_tail == NULL)
+                    lo = e;
+                else
+                    lo_tail->next = e;
+
+                lo_tail = e;
+            }
+            e->next = NULL;
+            e = e_next;
+        }
+        ht->b[i] = lo;
+        ht->b[i + ht->n] = hi;
+    }
+    ht->n *= 2;
+
+    return 0;
+}
+
+static void shrink_ht(struct ht *ht)
+{
+    /*
+     * Halves the number of buckets by appending each chain in the top half
+     * to its partner in the bottom half. Needs no memory, so cannot fail.
+     */
+    struct entry **t, *e;
+    size_t i, half = ht->n / 2;
+
+    for (i = 0; i < half; ++i) {
+        if (ht->b[i + half] == NULL)
+            continue;
+
+        if ((e = ht->b[i]) == NULL) {
+            ht->b[i] = ht->b[i + half];
+        } else {
+            while (e->next != NULL) e = e->next;
+
+            e->next = ht->b[i + half];
+            e->next->prev = e;
+        }
+    }
+    ht->n = half;
+
+    /* Keep the larger memory if it cannot be given back */
+    if ((t = realloc(ht->b, half * sizeof(struct entry *))) != NULL)
+        ht->b = t;
+}
+
+static struct entry *find(struct ht *ht, const char *name, size_t h)
 {
-    size_t bucket;
     struct entry *e;
 
-    bucket = hash_func(name, ht->n);
-    e = ht->b[bucket];
+    e = ht->b[h & (ht->n - 1)];
 
     while (e != NULL) {
-        if (!strcmp(name, e->name))
+        if (e->h == h && !strcmp(name, e->name))
             return e; /* Match */
 
         e = e->next;
@@ -123,17 +213,44 @@ struct entry *lookup(struct ht *ht, const char *name)
     return NULL; /* Not found */
 }
 
+static size_t filter_slot(const char *name, size_t len)
+{
+    /* Keys on the first byte, last byte and length, so no scan is needed */
+    size_t h;
+
+    h = (unsigned char) *name;
+    if (len)
+        h = h * 33 ^ (unsigned char) *(name + len - 1);
+
+    h = h * 33 ^ len;
+    return h & (HT_FILTER_SIZE - 1);
+}
+
+int may_exist(const struct ht *ht, const char *name, size_t len)
+{
+    /*
+     * Returns 0 when name, of length len, is definitely not in the hash
+     * table, without touching the buckets. Otherwise lookup must be used.
+     */
+    return ht->filter[filter_slot(name, len)] != 0;
+}
+
+struct entry *lookup(struct ht *ht, const char *name)
+{
+    return find(ht, name, hash_func(name));
+}
+
 int delete_entry(struct ht *ht, const char *name, int pop_hist)
 {
-    size_t bucket;
+    size_t h, bucket;
     struct entry *e;
 
-    e = lookup(ht, name);
+    h = hash_func(name);
 
-    if (e == NULL)
+    if ((e = find(ht, name, h)) == NULL)
         return 1; /* Error as not found */
 
-    bucket = hash_func(name, ht->n);
+    bucket = h & (ht->n - 1);
 
     if (pop_hist && e->hist != NULL) {
         /* Link in history, if present */
@@ -153,6 +270,10 @@ int delete_entry(struct ht *ht, const char *name, int pop_hist)
         /* Isolate history */
         e->hist = NULL;
     } else {
+        /* Name is removed */
+        --ht->filter[filter_slot(name, strlen(name))];
+        --ht->num;
+
         /* Link around. History will be deleted. */
         if (e->prev != NULL) {
             e->prev->next = e->next;
@@ -167,6 +288,11 @@ int delete_entry(struct ht *ht, const char *name, int pop_hist)
     }
 
     free_entry(e); /* Will free history too if not isolated */
+
+    /* Shrink when under a quarter full */
+    if (ht->n > ht->min_n && ht->num < ht->n / 4)
+        shrink_ht(ht);
+
     return 0;
 }
 
@@ -174,7 +300,7 @@ int upsert(struct ht *ht, const char *name, const char *def, Fptr func_p,
     int push_hist)
 {
     struct entry *e, *new_e = NULL;
-    size_t bucket;
+    size_t h, bucket;
     char *name_copy, *def_copy = NULL;
 
     if ((name_copy = strdup(name)) == NULL)
@@ -185,7 +311,15 @@ int upsert(struct ht *ht, const char *name, const char *def, Fptr func_p,
         mreturn(1);
     }
 
-    e = lookup(ht, name);
+    h = hash_func(name);
+    e = find(ht, name, h);
+
+    /* Grow before adding a name would take it over one per bucket */
+    if (e == NULL && ht->num >= ht->n && grow_ht(ht)) {
+        free(name_copy);
+        free(def_copy);
+        mreturn(1);
+    }
 
     if (e == NULL || push_hist) {
         /* Make a new entry */
@@ -199,12 +333,16 @@ int upsert(struct ht *ht, const char *name, const char *def, Fptr func_p,
     if (e == NULL) {
         /* New def */
         /* Link in at the head of the bucket collision chain */
-        bucket = hash_func(name, ht->n);
+        bucket = h & (ht->n - 1);
         if (ht->b[bucket] != NULL) {
             new_e->next = ht->b[bucket];
             ht->b[bucket]->prev = new_e;
         }
         ht->b[bucket] = new_e;
+        ++ht->filter[filter_slot(name, strlen(name))];
+        ++ht->num;
+
+        new_e->h = h;
 
         new_e->name = name_copy;
         new_e->def = def_copy;
@@ -218,6 +356,7 @@ int upsert(struct ht *ht, const char *name, const char *def, Fptr func_p,
         new_e->hist = e->hist;
         e->hist = new_e;
 
+        new_e->h = e->h;
         new_e->name = e->name;
         new_e->def = e->def;
         new_e->func_p = e->func_p;
@@ -42,7 +42,7 @@ apps='spot m4 bc freq tornado_dodge'
 
 make_executable() {
     ex_nm=$(printf %s "$1" | sed -E 's/\.o$//')
-    cc $cflags "$@" toucanlib.o -o "$ex_nm"
+    cc $cflags "$@" toucanlib.o -lpthread -o "$ex_nm"
 }
 
 
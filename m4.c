@@ -58,6 +58,12 @@
 #define NUM_DIVS             11
 #define DIVERSION_NEGATIVE_1 10
 
+/* Delimiters that a byte can commence. See set_delim. */
+#define DELIM_LEFT_COMMENT  1
+#define DELIM_RIGHT_COMMENT 2
+#define DELIM_LEFT_QUOTE    4
+#define DELIM_RIGHT_QUOTE   8
+
 /* Message */
 #define ms(desc)                                                              \
     fprintf(stderr, "%s:%lu [%s:%d]: %s: %s", m4->input->nm,                  \
@@ -160,7 +166,7 @@ struct m4_info {
     struct macro_call *stack; /* Head node of the macro call stack */
     size_t stack_depth;       /* For trace */
     Fptr tmp_mfp;             /* For passing back the defn of a built-in */
-    /* Used for substituting arguments and for esyscmd and translit */
+    /* Used for substituting arguments, esyscmd, translit and regexrep */
     struct obuf *tmp;
     struct obuf *wrap; /* Used for m4wrap */
     struct obuf *div[NUM_DIVS];
@@ -171,6 +177,13 @@ struct m4_info {
     char *left_quote;
     char *right_quote;
     size_t quote_depth;
+    /*
+     * First byte dispatch. Only a byte that commences a comment or quote is
+     * checked for one. Rebuilt by changecom and changequote.
+     */
+    unsigned char delim[UCHAR_MAX + 1];
+    /* Bytes that end a run of quoted or comment text. See get_run. */
+    struct byte_set delim_set;
     /*
      * Pass through the name of a built-in macro to output when called without
      * arguments. Otherwise an infinite loop would occur if the name was placed
@@ -372,7 +385,7 @@ int sub_args(M4ptr m4)
                 uw("Collected argument number %lu not accessed\n",
                     (unsigned long) i);
 
-    if (unget_str(m4->input, m4->tmp->a))
+    if (unget_obuf(m4->input, m4->tmp))
         mreturn(1);
 
     return 0;
@@ -434,6 +447,27 @@ void free_m4(M4ptr m4)
     }
 }
 
+void set_delim(M4ptr m4)
+{
+    size_t j;
+
+    memset(m4->delim, '\0', UCHAR_MAX + 1);
+
+    if (m4->left_comment != NULL && m4->right_comment != NULL) {
+        m4->delim[(unsigned char) *m4->left_comment] |= DELIM_LEFT_COMMENT;
+        m4->delim[(unsigned char) *m4->right_comment] |= DELIM_RIGHT_COMMENT;
+    }
+
+    m4->delim[(unsigned char) *m4->left_quote] |= DELIM_LEFT_QUOTE;
+    m4->delim[(unsigned char) *m4->right_quote] |= DELIM_RIGHT_QUOTE;
+
+    /* \0 is dropped by the tokeniser, so it also ends a run */
+    for (j = 0; j <= UCHAR_MAX; ++j) m4->delim_set.in[j] = m4->delim[j] != 0;
+
+    m4->delim_set.in['\0'] = 1;
+    init_byte_set(&m4->delim_set);
+}
+
 M4ptr init_m4(void)
 {
     M4ptr m4;
@@ -483,6 +517,8 @@ M4ptr init_m4(void)
     if ((m4->right_quote = strdup(DEFAULT_RIGHT_QUOTE)) == NULL)
         mgoto(error);
 
+    set_delim(m4);
+
     return m4;
 
 error:
@@ -810,6 +846,7 @@ int econc(m4_, NM)(void *v)
         m4->left_comment = NULL;
         free(m4->right_comment);
         m4->right_comment = NULL;
+        set_delim(m4);
         return 0;
     }
 
@@ -850,6 +887,7 @@ int econc(m4_, NM)(void *v)
     m4->left_comment = tmp_lc;
     free(m4->right_comment);
     m4->right_comment = tmp_rc;
+    set_delim(m4);
 
     return 0;
 }
@@ -904,6 +942,7 @@ int econc(m4_, NM)(void *v)
     m4->left_quote = tmp_lq;
     free(m4->right_quote);
     m4->right_quote = tmp_rq;
+    set_delim(m4);
 
     return 0;
 }
@@ -1250,8 +1289,6 @@ int econc(m4_, NM)(void *v)
 {
     M4ptr m4 = (M4ptr) v;
     int ret = 1;
-    char *res;
-    size_t res_len;
     int nl_insen = 0;   /* Newline insensitive off */
     int case_insen = 0; /* Case insensitive off */
     int verbose = 0;    /* Prints information about the regex */
@@ -1270,16 +1307,26 @@ int econc(m4_, NM)(void *v)
     if (!strcmp(arg(6), "1"))
         verbose = 1;
 
-    if ((ret = regex_replace(arg(1), strlen(arg(1)), arg(2), nl_insen,
-             case_insen, arg(3), &res, &res_len, verbose)))
+    m4->tmp->i = 0;
+    ret = regex_replace_to(arg(1), strlen(arg(1)), arg(2), nl_insen,
+        case_insen, arg(3), m4->tmp, verbose);
+
+    if (ret == NO_MATCH) {
+        /* Nothing replaced, so the text goes back as it is */
+        if (unget_str(m4->input, arg(1)))
+            mreturn(1);
+
+        return 0;
+    }
+
+    if (ret)
         return ret;
 
-    if (unget_str(m4->input, res)) {
-        free(res);
+    if (put_ch(m4->tmp, '\0'))
         mreturn(1);
-    }
 
-    free(res);
+    if (unget_obuf(m4->input, m4->tmp))
+        mreturn(1);
 
     return 0;
 }
@@ -1301,13 +1348,11 @@ int econc(m4_, NM)(void *v)
     if ((res = ls_dir(num_args_collected ? arg(1) : ".")) == NULL)
         mreturn(1);
 
-    if (unget_str(m4->input, res)) {
+    if (unget_own(m4->input, res, strlen(res))) {
         free(res);
         mreturn(1);
     }
 
-    free(res);
-
     return 0;
 }
 
@@ -1471,7 +1516,7 @@ int econc(m4_, NM)(void *v)
         }
     } else {
         /* Dump all macro definitions */
-        for (i = 0; i < NUM_BUCKETS; ++i) {
+        for (i = 0; i < m4->ht->n; ++i) {
             e = m4->ht->b[i];
             while (e != NULL) {
                 if (e->func_p == NULL) {
@@ -1695,7 +1740,7 @@ int econc(m4_, NM)(void *v)
     if (put_ch(m4->tmp, '\0'))
         mreturn(1);
 
-    if (unget_str(m4->input, m4->tmp->a))
+    if (unget_obuf(m4->input, m4->tmp))
         mreturn(1);
 
     return 0;
@@ -1943,7 +1988,7 @@ int econc(m4_, NM)(void *v)
     if (put_ch(m4->tmp, '\0'))
         mreturn(1);
 
-    if (unget_str(m4->input, m4->tmp->a))
+    if (unget_obuf(m4->input, m4->tmp))
         mreturn(1);
 #ifndef _WIN32
     st = WEXITSTATUS(st);
@@ -2063,7 +2108,7 @@ int econc(m4_, NM)(void *v)
 
     if (!num_args_collected) {
         /* Add all current macros to the trace hash table */
-        for (i = 0; i < NUM_BUCKETS; ++i) {
+        for (i = 0; i < m4->ht->n; ++i) {
             e = m4->ht->b[i];
             while (e != NULL) {
                 if (upsert(m4->trace_ht, e->name, NULL, NULL, 0))
@@ -2163,7 +2208,13 @@ int main(int argc, char **argv)
     struct entry *e; /* Entry for macro lookups */
     int i, r;
     char *p;
+    char ch;          /* Next byte of input */
+    unsigned char d;  /* Delimiters that it can commence */
+    size_t run_len;   /* Quoted or comment text passed through at once */
     int no_file = 1; /* No files specified on the command line */
+    struct regex_stats re_stats;
+    int print_re_stats = 0;
+    char re_stats_str[REGEX_STATS_BUF_SIZE];
 
     if (binary_io())
         mgoto(error);
@@ -2177,6 +2228,8 @@ int main(int argc, char **argv)
     if (tty_check(stdout, &m4->tty_output))
         mgoto(error);
 
+    set_regex_replace_threads(num_cpus());
+
 /* Load built-in macros */
 #define load_bi(m)                                                            \
     if (upsert(m4->ht, #m, NULL, &m4_##m, 0))                                 \
@@ -2227,13 +2280,17 @@ int main(int argc, char **argv)
     load_bi(recrm);
 
 #define program_usage                                                         \
-    "m4 [-s] [-D macro_name[=macro_def]] ... "                                \
+    "m4 [-s] [-R] [-D macro_name[=macro_def]] ... "                           \
     "[-U macro_name] ... file ..."
 
     /* Process command line arguments */
     for (i = 1; i < argc; ++i) {
         if (!strcmp(*(argv + i), "-s")) {
             m4->line_direct = 1;
+        } else if (!strcmp(*(argv + i), "-R")) {
+            memset(&re_stats, '\0', sizeof(struct regex_stats));
+            set_regex_stats(&re_stats);
+            print_re_stats = 1;
         } else if (!strcmp(*(argv + i), "-D")) {
             if (i + 1 == argc) {
                 fprintf(stderr, "[%s:%d]: Error: Usage: %s\n", __FILE__,
@@ -2305,76 +2362,86 @@ int main(int argc, char **argv)
         /* Clear diversion -1 */
         m4->div[DIVERSION_NEGATIVE_1]->i = 0;
 
-        if (m4->left_comment != NULL && m4->right_comment != NULL) {
-            if (!m4->comment_on) {
-                r = eat_str_if_match(&m4->input, m4->left_comment);
-                if (r == 1)
-                    mgoto(error);
+        /* Look at the next byte, to see if a delimiter could commence */
+        r = peek_ch(&m4->input, &ch);
+        if (r == 1)
+            mgoto(error);
 
-                if (output_line_directive(m4))
-                    mgoto(error);
+        if (output_line_directive(m4))
+            mgoto(error);
 
-                if (r == MATCH) {
-                    if (put_str(output, m4->left_comment))
-                        mgoto(error);
+        d = r == EOF ? 0 : m4->delim[(unsigned char) ch];
 
-                    m4->comment_on = 1;
+        if (!m4->comment_on && d & DELIM_LEFT_COMMENT) {
+            r = eat_str_if_match(&m4->input, m4->left_comment);
+            if (r == 1)
+                mgoto(error);
 
-                    /* As might have a right comment immediately afterwards */
-                    goto top;
-                }
-            } else {
-                r = eat_str_if_match(&m4->input, m4->right_comment);
-                if (r == 1)
+            if (r == MATCH) {
+                if (put_str(output, m4->left_comment))
                     mgoto(error);
 
-                if (output_line_directive(m4))
-                    mgoto(error);
+                m4->comment_on = 1;
 
-                if (r == MATCH) {
-                    if (put_str(output, m4->right_comment))
-                        mgoto(error);
+                /* As might have a right comment immediately afterwards */
+                goto top;
+            }
+        } else if (m4->comment_on && d & DELIM_RIGHT_COMMENT) {
+            r = eat_str_if_match(&m4->input, m4->right_comment);
+            if (r == 1)
+                mgoto(error);
+
+            if (r == MATCH) {
+                if (put_str(output, m4->right_comment))
+                    mgoto(error);
 
-                    m4->comment_on = 0;
+                m4->comment_on = 0;
 
-                    /* As might have a left comment immediately afterwards */
-                    goto top;
-                }
+                /* As might have a left comment immediately afterwards */
+                goto top;
             }
         }
 
-        r = eat_str_if_match(&m4->input, m4->left_quote);
-        if (r == 1)
-            mgoto(error);
+        if (d & DELIM_LEFT_QUOTE) {
+            r = eat_str_if_match(&m4->input, m4->left_quote);
+            if (r == 1)
+                mgoto(error);
 
-        if (output_line_directive(m4))
-            mgoto(error);
+            if (r == MATCH) {
+                if (m4->quote_depth && put_str(output, m4->left_quote))
+                    mgoto(error);
+
+                ++m4->quote_depth;
+                /* As might have multiple quotes in a row */
+                goto top;
+            }
+        }
 
-        if (r == MATCH) {
-            if (m4->quote_depth && put_str(output, m4->left_quote))
+        if (d & DELIM_RIGHT_QUOTE) {
+            r = eat_str_if_match(&m4->input, m4->right_quote);
+            if (r == 1)
                 mgoto(error);
 
-            ++m4->quote_depth;
-            /* As might have multiple quotes in a row */
-            goto top;
-        }
+            if (r == MATCH) {
+                if (m4->quote_depth != 1 && put_str(output, m4->right_quote))
+                    mgoto(error);
 
-        r = eat_str_if_match(&m4->input, m4->right_quote);
-        if (r == 1)
-            mgoto(error);
+                if (m4->quote_depth)
+                    --m4->quote_depth;
 
-        if (output_line_directive(m4))
-            mgoto(error);
+                /* As might have multiple quotes in a row */
+                goto top;
+            }
+        }
 
-        if (r == MATCH) {
-            if (m4->quote_depth != 1 && put_str(output, m4->right_quote))
+        if ((m4->comment_on || m4->quote_depth) && r != EOF
+            && !m4->delim_set.in[(unsigned char) ch]) {
+            /* Pass through all of the text up to the next delimiter */
+            if (get_run(m4->input, &m4->delim_set, output, &run_len))
                 mgoto(error);
 
-            if (m4->quote_depth)
-                --m4->quote_depth;
-
-            /* As might have multiple quotes in a row */
-            goto top;
+            if (run_len)
+                goto top;
         }
 
         /* Not a quote, so read a token */
@@ -2386,11 +2453,9 @@ int main(int argc, char **argv)
                 if (put_ch(m4->wrap, '\0'))
                     mgoto(error);
 
-                if (unget_str(m4->input, m4->wrap->a))
+                if (unget_obuf(m4->input, m4->wrap))
                     mgoto(error);
 
-                m4->wrap->i = 0;
-
                 goto top;
             }
             break;
@@ -2443,7 +2508,8 @@ int main(int argc, char **argv)
         } else {
             e = NULL;
             /* Short circuit */
-            if (isalpha(*m4->token->a) || *m4->token->a == '_')
+            if ((isalpha(*m4->token->a) || *m4->token->a == '_')
+                && may_exist(m4->ht, m4->token->a, m4->token->i - 1))
                 e = lookup(m4->ht, m4->token->a);
 
             if (e == NULL) {
@@ -2535,6 +2601,15 @@ clean_up:
     }
 
     free_m4(m4);
+    free_regex_cache();
+
+    if (print_re_stats) {
+        set_regex_stats(NULL);
+        if (regex_stats_to_str(&re_stats, re_stats_str, REGEX_STATS_BUF_SIZE))
+            ret = 1;
+        else
+            fprintf(stderr, "m4: %s\n", re_stats_str);
+    }
 
     /*
      * A requested exit value of zero will be overwritten if there has been
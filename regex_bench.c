@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* regex_bench: Throughput benchmark for toco_regex */
+
+#include "toucanlib.h"
+
+#define DEFAULT_CORPUS_MB 4
+#define MAX_CORPUS_MB     1024
+/* Each measurement is repeated until at least this much time has passed */
+#define MIN_BENCH_SEC 0.2
+#define LINE_BUF_SIZE 256
+
+#define NUM_CORPORA 4
+
+static const char *corpus_name[NUM_CORPORA]
+    = { "log", "code", "random", "long_line" };
+
+struct pattern {
+    const char *find;
+    const char *replace;
+    int nl_ins;
+};
+
+static const struct pattern pat[] = {
+    /* Literals and simple sets */
+    { "ERROR", "E", 0 },
+    { "status=5[0-9][0-9]", "status=5xx", 0 },
+    { "[0-9]+ms", "N", 0 },
+    { "id=[0-9]+ took", "", 0 },
+    { "[\\x80-\\xFF][\\x80-\\xFF]", "", 0 },
+    /* Anchors */
+    { "^[0-9]+-[0-9]+-[0-9]+", "DATE", 0 },
+    { "NULL\\)$", "0)", 0 },
+    /* Alternation and repetition */
+    { "(foo|bar|node|size)_[a-z]+", "x", 0 },
+    { "[a-z]+_[a-z]+\\(", "f(", 0 },
+    { ".*took", "", 0 },
+    { "zq.*zq", "", 1 },
+    /* Pathological for backtracking engines */
+    { "(a|aa)*b", "b", 0 },
+    { "(x+x+)+y", "y", 0 },
+    { "(a*)*b", "b", 0 },
+    { "(a|a)*c", "c", 0 },
+};
+
+static unsigned long next_rand(unsigned long *x)
+{
+    /* Deterministic, so that the corpora are the same on every platform */
+    *x = (*x * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+    return *x >> 16;
+}
+
+static int gen_corpus(int type, size_t size, struct obuf *b)
+{
+    static const char *level[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN",
+        "ERROR" };
+    static const unsigned long status[] = { 200, 200, 200, 301, 404, 500,
+        503 };
+    static const char *word[] = { "buf", "size", "foo", "bar", "reg", "text",
+        "node", "len" };
+    char line[LINE_BUF_SIZE];
+    unsigned long x = 1, r, n;
+    int w;
+
+    b->i = 0;
+    while (b->i < size) {
+        w = 0;
+        switch (type) {
+        case 0:
+            w = snprintf(line, LINE_BUF_SIZE,
+                "2026-%02lu-%02lu %02lu:%02lu:%02lu %s worker-%lu request "
+                "id=%lu took %lums status=%lu\n",
+                next_rand(&x) % 12 + 1, next_rand(&x) % 28 + 1,
+                next_rand(&x) % 24, next_rand(&x) % 60, next_rand(&x) % 60,
+                level[next_rand(&x) % 6], next_rand(&x) % 16,
+                next_rand(&x), next_rand(&x) % 1000,
+                status[next_rand(&x) % 7]);
+            break;
+        case 1:
+            switch (next_rand(&x) % 6) {
+            case 0:
+                w = snprintf(line, LINE_BUF_SIZE, "    if (%s_%s == NULL)\n",
+                    word[next_rand(&x) % 8], word[next_rand(&x) % 8]);
+                break;
+            case 1:
+                w = snprintf(line, LINE_BUF_SIZE,
+                    "        return %s_%s(%s, %lu);\n",
+                    word[next_rand(&x) % 8], word[next_rand(&x) % 8],
+                    word[next_rand(&x) % 8], next_rand(&x) % 100);
+                break;
+            case 2:
+                w = snprintf(line, LINE_BUF_SIZE, "    %s = %s + %lu;\n",
+                    word[next_rand(&x) % 8], word[next_rand(&x) % 8],
+                    next_rand(&x) % 100);
+                break;
+            case 3:
+                w = snprintf(line, LINE_BUF_SIZE, "/* Updates the %s %s */\n",
+                    word[next_rand(&x) % 8], word[next_rand(&x) % 8]);
+                break;
+            case 4:
+                w = snprintf(line, LINE_BUF_SIZE,
+                    "static int %s_%s(const char *%s)\n{\n",
+                    word[next_rand(&x) % 8], word[next_rand(&x) % 8],
+                    word[next_rand(&x) % 8]);
+                break;
+            case 5:
+                w = snprintf(line, LINE_BUF_SIZE, "}\n\n");
+                break;
+            }
+            break;
+        case 2:
+            line[w++] = (char) (next_rand(&x) & 0xFF);
+            break;
+        case 3:
+            /* Runs of a or x, without a \n, so the text is one line */
+            r = next_rand(&x);
+            n = r % 64 + 1;
+            while (n--) line[w++] = r & 0x100 ? 'a' : 'x';
+
+            line[w++] = ' ';
+            break;
+        }
+        if (w < 0 || w >= LINE_BUF_SIZE)
+            mreturn(1);
+
+        if (put_mem(b, line, (size_t) w))
+            mreturn(1);
+    }
+    b->i = size;
+
+    return 0;
+}
+
+static double secs_since(clock_t start)
+{
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static int bench(int type, const char *text, size_t size, size_t i)
+{
+    /* Runs pattern i over the corpus and prints one row of results */
+    int ret = 1;
+    struct regex *reg = NULL;
+    struct regex_iter it;
+    const char *find = pat[i].find;
+    int nl_ins = pat[i].nl_ins;
+    char *res;
+    size_t res_len, mo, ml, reps, matches = 0, mem = 0;
+    double t, compile_us, search_mbs, replace_mbs, mb;
+    clock_t start;
+    int r;
+
+    mb = (double) size / 1000000;
+
+    /* Compile */
+    reps = 0;
+    start = clock();
+    do {
+        if (regex_compile(find, nl_ins, 0, &reg, 0))
+            mgoto(clean_up);
+
+        regex_free(reg);
+        reg = NULL;
+        ++reps;
+    } while ((t = secs_since(start)) < MIN_BENCH_SEC);
+    compile_us = t / reps * 1000000;
+
+    if (regex_compile(find, nl_ins, 0, &reg, 0))
+        mgoto(clean_up);
+
+    /* Search, visiting every match, as regex_search would one at a time */
+    reps = 0;
+    start = clock();
+    do {
+        if (regex_iter_init(&it, reg, text, size, NULL, 0, 1, 0))
+            mgoto(clean_up);
+
+        matches = 0;
+        while (!(r = regex_iter_next(&it, &mo, &ml, 0))) ++matches;
+
+        if (r != NO_MATCH)
+            mgoto(clean_up);
+
+        ++reps;
+    } while ((t = secs_since(start)) < MIN_BENCH_SEC);
+    search_mbs = mb * reps / t;
+
+    /* Replace */
+    reps = 0;
+    start = clock();
+    do {
+        if (regex_exec_replace(
+                reg, text, size, pat[i].replace, &res, &res_len, 0))
+            mgoto(clean_up);
+
+        free(res);
+        ++reps;
+    } while ((t = secs_since(start)) < MIN_BENCH_SEC);
+    replace_mbs = mb * reps / t;
+
+    if (peak_mem(&mem))
+        mgoto(clean_up);
+
+    printf("%-9s %-26s %9.1f %10.1f %9lu %10.1f %8lu %8lu\n",
+        corpus_name[type], find, compile_us, search_mbs,
+        (unsigned long) matches, replace_mbs,
+        (unsigned long) (regex_mem_size(reg) / 1024),
+        (unsigned long) (mem / 1024));
+
+    ret = 0;
+
+clean_up:
+    regex_free(reg);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 1;
+    struct obuf *b = NULL;
+    unsigned long mb = DEFAULT_CORPUS_MB;
+    size_t size, i;
+    int type;
+
+    if (argc > 2) {
+        fprintf(stderr, "Usage: regex_bench [corpus_size_MB]\n");
+        return 1;
+    }
+
+    if (binary_io())
+        return 1;
+
+    if (argc == 2 && (str_to_num(*(argv + 1), MAX_CORPUS_MB, &mb) || !mb)) {
+        fprintf(stderr, "regex_bench: Invalid corpus size\n");
+        return 1;
+    }
+
+    size = mb * 1000000;
+
+    if ((b = init_obuf(size + LINE_BUF_SIZE)) == NULL)
+        mgoto(clean_up);
+
+    printf("%-9s %-26s %9s %10s %9s %10s %8s %8s\n", "corpus", "pattern",
+        "compile", "search", "matches", "replace", "regex", "peak");
+    printf("%-9s %-26s %9s %10s %9s %10s %8s %8s\n", "", "", "us", "MB/s", "",
+        "MB/s", "KB", "KB");
+
+    for (type = 0; type < NUM_CORPORA; ++type) {
+        if (gen_corpus(type, size, b))
+            mgoto(clean_up);
+
+        for (i = 0; i < sizeof(pat) / sizeof(struct pattern); ++i)
+            if (bench(type, b->a, size, i))
+                mgoto(clean_up);
+    }
+
+    ret = 0;
+
+clean_up:
+    free_obuf(b);
+
+    return ret;
+}
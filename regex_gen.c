@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2026 Logan Ryan McLintock. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * regex_gen: Compiles a regex at build time into C source, which
+ * regex_load turns into a handle without compiling at run time.
+ */
+
+#include "toucanlib.h"
+
+static int valid_name(const char *name)
+{
+    /* C identifier */
+    const char *p = name;
+
+    if (!isalpha((unsigned char) *p) && *p != '_')
+        return 0;
+
+    for (++p; *p != '\0'; ++p)
+        if (!isalnum((unsigned char) *p) && *p != '_')
+            return 0;
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int ret = 1;
+    struct regex *reg = NULL;
+    int nl_ins = 0, case_ins = 0, i = 1;
+
+    for (; i < argc && **(argv + i) == '-'; ++i) {
+        if (!strcmp(*(argv + i), "-n"))
+            nl_ins = 1;
+        else if (!strcmp(*(argv + i), "-i"))
+            case_ins = 1;
+        else
+            break;
+    }
+
+    if (argc - i != 2 || !valid_name(*(argv + i))) {
+        fprintf(stderr, "Usage: regex_gen [-n] [-i] name regex > file.c\n");
+        return 1;
+    }
+
+    if (binary_io())
+        return 1;
+
+    if (regex_compile(*(argv + i + 1), nl_ins, case_ins, &reg, 0))
+        mgoto(clean_up);
+
+    if (printf("/* Generated by regex_gen. Do not edit. */\n\n"
+               "#include \"toucanlib.h\"\n\n")
+        < 0)
+        mgoto(clean_up);
+
+    if (regex_write_tables(reg, *(argv + i), stdout))
+        mgoto(clean_up);
+
+    if (fflush(stdout))
+        mgoto(clean_up);
+
+    ret = 0;
+
+clean_up:
+    regex_free(reg);
+
+    return ret;
+}
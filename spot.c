@@ -72,6 +72,9 @@ struct editor {
     struct gb *tmp; /* Temporary buffer */
     /* ' ' = None, s = Exact search, z = Regex search, c = Case insen regex */
     char search_type;
+    struct regex *se_reg; /* Compiled regex of the last regex search */
+    struct regex_stats stats; /* Of all regex searches */
+    int show_stats;           /* Show the regex statistics on the status bar */
     int cl_active; /* Cursor is in the command line */
     /* The command line operation which is in progress */
     char op; /* ' ' = None */
@@ -98,6 +101,8 @@ static void free_editor(struct editor *ed)
     ed->se = NULL;
     free_gb(ed->tmp);
     ed->tmp = NULL;
+    regex_free(ed->se_reg);
+    ed->se_reg = NULL;
 }
 
 static int init_editor(struct editor *ed)
@@ -118,6 +123,9 @@ static int init_editor(struct editor *ed)
     ed->se = NULL;
     ed->tmp = NULL;
     ed->search_type = ' ';
+    ed->se_reg = NULL;
+    memset(&ed->stats, '\0', sizeof(struct regex_stats));
+    ed->show_stats = 0;
     ed->cl_active = 0;
     ed->op = ' ';
 
@@ -429,10 +437,34 @@ static void ed_repeat_search(struct editor *ed)
         ed->rv = exact_forward_search(ed->b, ed->se);
         break;
     case 'z':
-        ed->rv = regex_forward_search(ed->b, ed->se, 0);
+    case 'c': /* Case insensitive */
+        /* Reuse the compiled regex */
+        if (ed->se_reg == NULL)
+            ed->rv = 1;
+        else
+            ed->rv = regex_forward_search(ed->b, ed->se_reg);
+
+        break;
+    default:
+        ed->rv = 1;
+        break;
+    }
+}
+
+static void ed_repeat_search_backward(struct editor *ed)
+{
+    /* Repeat last search, going backwards */
+    switch (ed->search_type) {
+    case 's':
+        ed->rv = exact_backward_search(ed->b, ed->se);
         break;
+    case 'z':
     case 'c': /* Case insensitive */
-        ed->rv = regex_forward_search(ed->b, ed->se, 1);
+        if (ed->se_reg == NULL)
+            ed->rv = 1;
+        else
+            ed->rv = regex_backward_search(ed->b, ed->se_reg);
+
         break;
     default:
         ed->rv = 1;
@@ -440,6 +472,14 @@ static void ed_repeat_search(struct editor *ed)
     }
 }
 
+static void ed_toggle_regex_stats(struct editor *ed)
+{
+    /* Counting starts over each time that the statistics are shown */
+    ed->show_stats = !ed->show_stats;
+    if (ed->show_stats)
+        memset(&ed->stats, '\0', sizeof(struct regex_stats));
+}
+
 static void ed_execute_cl(struct editor *ed)
 {
     struct gb *t; /* For switching gap buffers */
@@ -459,12 +499,16 @@ static void ed_execute_cl(struct editor *ed)
                 ed->rv = exact_forward_search(ed->b, ed->se);
                 break;
             case 'z':
-                ed->search_type = 'z';
-                ed->rv = regex_forward_search(ed->b, ed->se, 0);
-                break;
             case 'a':
-                ed->search_type = 'c';
-                ed->rv = regex_forward_search(ed->b, ed->se, 1);
+                ed->search_type = ed->op == 'z' ? 'z' : 'c';
+                regex_free(ed->se_reg);
+                ed->se_reg = NULL;
+                start_of_gb(ed->se);
+                if ((ed->rv = regex_compile((char *) ed->se->a + ed->se->c, 0,
+                         ed->op == 'a', &ed->se_reg, 0)))
+                    break;
+
+                ed->rv = regex_forward_search(ed->b, ed->se_reg);
                 break;
             }
             break;
@@ -517,6 +561,7 @@ int draw(struct editor *ed)
     int have_centred = 0;
     unsigned char ch;
     char num_str[NUM_BUF_SIZE];
+    char stats_str[REGEX_STATS_BUF_SIZE];
     int r, len;
     size_t h;  /* Screen height */
     size_t w;  /* Screen width */
@@ -642,6 +687,13 @@ start:
             *num_str = '\0';
         }
 
+        if (ed->show_stats) {
+            if (regex_stats_to_str(&ed->stats, stats_str, sizeof(stats_str)))
+                return 1;
+        } else {
+            *stats_str = '\0';
+        }
+
         move(h - 2, 0);
 
         if (ed->sb_s < w) {
@@ -652,11 +704,11 @@ start:
             ed->sb_s = w + 1;
         }
 
-        len = snprintf(ed->sb, ed->sb_s, "%c%c %s (%lu,%lu) %02X %s %s",
+        len = snprintf(ed->sb, ed->sb_s, "%c%c %s (%lu,%lu) %02X %s %s %s",
             ed->rv ? '!' : ' ', b->mod ? '*' : ' ', b->fn,
             (unsigned long) b->r, (unsigned long) b->col,
             ed->cl_active ? *(cl->a + cl->c) : *(b->a + b->c), num_str,
-            ed->msg);
+            ed->msg, stats_str);
         if (len < 0)
             return 1;
 
@@ -875,6 +927,8 @@ int main(int argc, char **argv)
         { &ed_left_buffer, { C('x'), KEY_LEFT, EKS } },
         { &ed_right_buffer, { C('x'), KEY_RIGHT, EKS } },
         { &ed_repeat_search, { ESC, 'n', EKS } },
+        { &ed_repeat_search_backward, { ESC, 'p', EKS } },
+        { &ed_toggle_regex_stats, { ESC, 's', EKS } },
         { &ed_undo, { ESC, '-', EKS } },
         { &ed_redo, { ESC, '=', EKS } },
 
@@ -890,6 +944,9 @@ int main(int argc, char **argv)
     if (init_editor(&ed))
         mgoto(clean_up);
 
+    set_regex_replace_threads(num_cpus());
+    set_regex_stats(&ed.stats);
+
     if (initscr() == NULL)
         mgoto(clean_up);
 
@@ -927,6 +984,7 @@ clean_up:
         ret = 1;
 
     free_editor(&ed);
+    free_regex_cache();
 
     return ret;
 }
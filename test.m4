@@ -93,3 +93,11 @@ pushdef(`w', jjjjj)
 pushdef(`w', sjsj)
 popdef(`z')
 popdef(`y')
+changecom(`%')dnl
+define(`h', `LLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLLL')dnl
+define(`L', h`'h` m 1234567890
+')dnl
+define(`m', `# abc')dnl
+define(`s', `L xyz')dnl
+changecom(`#')dnl
+s
@@ -49,15 +49,66 @@
 
 #define INIT_NUM_NODES         100
 #define INIT_OPERAND_STACK_NUM 100
+#define INIT_DFA_STATES        16
+#define INIT_DFA_POOL          256
+#define INIT_CLOSURE_POOL      256
+
+/*
+ * Prefilter limits. A larger first byte set is not worth skipping with.
+ * Finding the required literal is quadratic in the number of nodes.
+ */
+#define FIRST_BYTE_MAX  32
+#define REQ_LIT_MAX_NODES 1024
+
+/* Positions that fit in the word used by the bit-parallel engine */
+#define BP_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/* Number of compiled regexes kept by regex_search and regex_replace */
+#define REGEX_CACHE_SIZE 16
+
+/* Default cap on the memory used by the DFA cache of each regex, in bytes */
+#define DFA_MEM_LIMIT (1 << 21)
+
+/* Smallest chunk of text worth giving its own replace thread, in bytes */
+#define REPLACE_CHUNK_MIN (1 << 20)
+#define REPLACE_MAX_THREADS 64
+
+/* Cache flushes allowed per search, before falling back to the NFA */
+#define DFA_MAX_FLUSHES 3
+
+/* Special DFA transitions */
+#define DFA_UNKNOWN SIZE_MAX       /* Not built yet */
+#define DFA_NEWLINE (SIZE_MAX - 1) /* \n in newline sensitive mode */
 
 /* Lookup in storage */
-#define lk(n) (*(ns->a + (n)))
+#define lk_type(n)  (ns->type[n])
+#define lk_link0(n) (ns->link0[n])
+#define lk_link1(n) (ns->link1[n])
+#define lk_cs(n)    (ns->cs_store + ns->cs[n] * CS_SIZE)
+
+/* Char sets are bitsets of UCHAR_MAX + 1 bits */
+#define CS_SIZE        ((UCHAR_MAX + 1) / CHAR_BIT)
+#define cs_test(cs, u) ((cs)[(u) / CHAR_BIT] & 1 << (u) % CHAR_BIT)
+#define cs_set(cs, u)  ((cs)[(u) / CHAR_BIT] |= 1 << (u) % CHAR_BIT)
+#define cs_clear(cs, u)                                                       \
+    ((cs)[(u) / CHAR_BIT] &= (unsigned char) ~(1 << (u) % CHAR_BIT))
 
 /* Sets link_type to END_NODE */
-#define clear_node(n) memset(ns->a + (n), '\0', sizeof(struct nfa_node))
+#define clear_node(n)                                                         \
+    do {                                                                      \
+        lk_type(n) = END_NODE;                                                \
+        lk_link0(n) = 0;                                                      \
+        lk_link1(n) = 0;                                                      \
+        ns->cs[n] = 0;                                                        \
+    } while (0)
 
 #define copy_node(dst, src)                                                   \
-    memcpy(ns->a + (dst), ns->a + (src), sizeof(struct nfa_node))
+    do {                                                                      \
+        lk_type(dst) = lk_type(src);                                          \
+        lk_link0(dst) = lk_link0(src);                                        \
+        lk_link1(dst) = lk_link1(src);                                        \
+        ns->cs[dst] = ns->cs[src];                                            \
+    } while (0)
 
 /* operator: */
 #define LEFT_PAREN   0
@@ -82,6 +133,8 @@
 #define SOL_READ_STATUS 3
 #define EOL_READ_STATUS 4
 #define CHAR_SET        5
+/* Merged away by concatenation. Removed when construction is complete. */
+#define DEAD_NODE 6
 
 struct operator_detail {
     unsigned char precedence;
@@ -90,24 +143,24 @@ struct operator_detail {
 };
 
 struct regex_item {
-    unsigned char *char_set;
+    unsigned char char_set[CS_SIZE];
+    size_t cs; /* Index of the deduplicated copy of char_set */
     unsigned char operator;
     struct regex_item *next;
 };
 
-struct nfa_node {
-    unsigned char *char_set;
-    char link_type;
-    size_t link0;
-    size_t link1;
-};
-
+/*
+ * Nodes are stored as a structure of arrays, so that the matchers can stream
+ * through the fields that they need.
+ */
 struct nfa_storage {
-    struct nfa_node *a;
+    unsigned char *type; /* link_type */
+    size_t *link0;
+    size_t *link1;
+    size_t *cs; /* Char set of CHAR_SET nodes, as an index into cs_store */
+    const unsigned char *cs_store; /* Belongs to the regex */
     size_t i;
-    size_t n;     /* Number of elements, not bytes */
-    size_t reuse; /* For reusing deleted nodes */
-    unsigned char reuse_set;
+    size_t n; /* Number of elements, not bytes */
 };
 
 /* Each NFA fragment is itself a valid NFA */
@@ -122,6 +175,45 @@ struct operand_stack {
     size_t n; /* Number of elements, not bytes */
 };
 
+/* Set of nodes with constant time insert, membership test, and clear */
+struct sparse_set {
+    size_t *dense;  /* Members, in order of insertion */
+    size_t *sparse; /* Index of each member in dense */
+    size_t i;       /* Number of members */
+};
+
+/*
+ * A DFA state is identified by its kernel: the set of NFA nodes entered by
+ * the last character read. The start node is implicitly added to every
+ * kernel, as the DFA is unanchored. The empty kernel therefore means that
+ * all threads, other than the one just commencing, have been eliminated.
+ */
+struct dfa_state {
+    size_t kernel;          /* Offset of the sorted kernel in the pool */
+    size_t kernel_size;     /* Number of nodes in the kernel */
+    size_t char_nodes;      /* Offset of the in-state CHAR_SET nodes */
+    size_t char_nodes_size; /* Number of in-state CHAR_SET nodes */
+    int sol;                /* Start of line read status */
+    unsigned char match;     /* End node is in-state mid-line */
+    unsigned char eol_match; /* End node is in-state at the end of a line */
+};
+
+/* Lazily built DFA cache */
+struct dfa {
+    struct dfa_state *st;
+    size_t *trans; /* row transitions per state */
+    size_t row;    /* Number of byte classes */
+    size_t i;      /* Number of states */
+    size_t n;      /* Allocated number of states */
+    size_t *pool;  /* Node sets of the states */
+    size_t pool_i;
+    size_t pool_n;
+    size_t *ht;      /* Hash table of state index plus one. 0 is empty. */
+    size_t ht_n;     /* Number of slots, a power of two */
+    size_t start[2]; /* States with an empty kernel, indexed by sol */
+    size_t flushes;  /* Number of times that the cache was flushed */
+};
+
 struct regex {
     char *find_esc;
     size_t find_esc_size;
@@ -131,10 +223,107 @@ struct regex {
     size_t nfa_start;
     size_t nfa_end;
     int nl_ins; /* Newline insensitive matching */
-    unsigned char *state;
-    unsigned char *state_next;
+    unsigned char *cs_store; /* Distinct char sets, CS_SIZE bytes each */
+    size_t cs_num;
+    /*
+     * Bytes in the same class are in exactly the same char sets, so the
+     * automata cannot tell them apart.
+     */
+    unsigned char byte_class[UCHAR_MAX + 1];
+    size_t num_classes;
+    /*
+     * Active sets. ss holds the in-state CHAR_SET nodes (and the end node).
+     * kern holds the nodes entered by the last character read.
+     */
+    struct sparse_set *ss;
+    struct sparse_set *kern;
+    /*
+     * The offset in the text that the thread of each active node commenced
+     * from, indexed by node. Only valid for members of ss and kern,
+     * respectively, so these never need clearing.
+     */
+    size_t *state;
+    size_t *state_next;
+    /*
+     * Precomputed epsilon closures, keeping only CHAR_SET nodes and the end
+     * node. Closure k is cl[cl_off[k]] up to cl[cl_off[k + 1]]. See cl_key.
+     */
+    size_t *cl;
+    size_t *cl_off;
+    /*
+     * Reversed automaton, for searching backwards. See build_rev_closures.
+     * Uses its own active sets, as the NFA is run forwards to work out
+     * the length of each match that it finds.
+     */
+    size_t *rcl;
+    size_t *rcl_off;
+    unsigned char *rev_start; /* Bit sol is set when the start node leads in */
+    unsigned char rev_empty[2][2]; /* Empty match, by sol, eol */
+    struct sparse_set *rev_ss;
+    struct sparse_set *rev_kern;
+    struct dfa *dfa; /* NULL when the DFA is switched off */
+    struct regex_stats *stats; /* NULL when not recording */
+    /*
+     * Prefilter, used to skip to where a match could commence.
+     * See build_prefilter.
+     */
+    int anchored; /* Matches can only commence at the start of a line */
+    int no_empty; /* Cannot match the empty string */
+    struct byte_set first_set; /* Bytes that can start a match */
+    unsigned char *prefix; /* Literal that every match commences with */
+    size_t prefix_len;
+    unsigned char *req; /* Literal that every match contains */
+    size_t req_len;
+    /*
+     * Bit-parallel engine (Glushkov automaton). Each CHAR_SET node is a
+     * position, with one bit in a word. Used instead of the DFA when all of
+     * the positions fit. The follow set of a position is the positions
+     * in-state after it reads a character. These are combined into tables
+     * of unions, one for each 8-bit chunk of the word.
+     */
+    int bp;                            /* Bit-parallel engine is in use */
+    size_t bp_num;                     /* Number of positions */
+    unsigned long bp_b[UCHAR_MAX + 1]; /* Positions that can read each byte */
+    unsigned long *bp_follow;          /* UCHAR_MAX + 1 per chunk */
+    unsigned long bp_start[2]; /* In-state positions at the start, by sol */
+    unsigned long bp_final[2]; /* Positions that reach the end, by eol */
+    unsigned char bp_empty[2][2]; /* Start node reaches the end, by sol, eol */
 };
 
+/* Shared by all regexes. Zero switches the DFA off. */
+static size_t dfa_mem_limit = DFA_MEM_LIMIT;
+
+/* Threads that regex_exec_replace can use. See parallel_replace. */
+static size_t replace_threads = 1;
+
+/* Where new regexes record their statistics. See set_regex_stats. */
+static struct regex_stats *stats_sink = NULL;
+
+/* A chunk of text for a replace thread */
+struct replace_job {
+    struct regex reg; /* Copy of the regex, with its own scratch */
+    const char *text;
+    size_t text_size;
+    int nl; /* The chunk is followed by a \n, which is passed through */
+    const char *replace;
+    size_t replace_size;
+    struct obuf *output;
+    struct regex_stats stats;
+    int ret;
+};
+
+struct regex_cache_entry {
+    char *regex_str;
+    int nl_ins;
+    int case_ins;
+    struct regex *reg;
+};
+
+/* Most recently used first */
+static struct regex_cache_entry regex_cache[REGEX_CACHE_SIZE];
+static size_t regex_cache_i;
+static unsigned long regex_cache_hits, regex_cache_misses;
+
 struct operator_detail op_detail[] = {
     { 4, '_', "(" }, /* LEFT_PAREN */
     { 4, '_', ")" }, /* RIGHT_PAREN */
@@ -159,74 +348,86 @@ static void free_regex_chain(struct regex_item *head)
     struct regex_item *t;
     while (head != NULL) {
         t = head->next;
-        free(head->char_set);
         free(head);
         head = t;
     }
 }
 
-static struct nfa_storage *init_nfa_storage(void)
+static void free_nfa_storage(struct nfa_storage *ns)
+{
+    if (ns != NULL) {
+        free(ns->type);
+        free(ns->link0);
+        free(ns->link1);
+        free(ns->cs);
+        free(ns);
+    }
+}
+
+static struct nfa_storage *init_nfa_storage(const unsigned char *cs_store)
 {
     struct nfa_storage *t = NULL;
 
     if ((t = calloc(1, sizeof(struct nfa_storage))) == NULL)
         mgoto(error);
 
-    if (sizeof(struct nfa_node)
-        && INIT_NUM_NODES > SIZE_MAX / sizeof(struct nfa_node))
+    if (INIT_NUM_NODES > SIZE_MAX / sizeof(size_t))
+        mgoto(error);
+
+    if ((t->type = calloc(INIT_NUM_NODES, 1)) == NULL)
+        mgoto(error);
+
+    if ((t->link0 = calloc(INIT_NUM_NODES, sizeof(size_t))) == NULL)
         mgoto(error);
 
-    if ((t->a = calloc(INIT_NUM_NODES, sizeof(struct nfa_node))) == NULL)
+    if ((t->link1 = calloc(INIT_NUM_NODES, sizeof(size_t))) == NULL)
         mgoto(error);
 
+    if ((t->cs = calloc(INIT_NUM_NODES, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    t->cs_store = cs_store;
     t->n = INIT_NUM_NODES;
 
     return t;
 
 error:
-    if (t != NULL) {
-        free(t->a);
-        free(t);
-    }
-
+    free_nfa_storage(t);
     return NULL;
 }
 
-static void free_nfa_storage(struct nfa_storage *ns)
-{
-    if (ns != NULL) {
-        free(ns->a);
-        free(ns);
-    }
-}
-
 static int issue_node(struct nfa_storage *ns, size_t *node)
 {
-    struct nfa_node *t;
-    size_t new_n, new_size_in_bytes;
-
-    if (ns->reuse_set) {
-        clear_node(ns->reuse);
-        *node = ns->reuse;
-        ns->reuse_set = 0;
-        return 0;
-    }
+    unsigned char *t_type;
+    size_t *t, new_n;
 
     if (ns->i == ns->n) {
         if (ns->n > SIZE_MAX / 2)
             mgoto(error);
 
         new_n = ns->n * 2;
-        if (sizeof(struct nfa_node)
-            && new_n > SIZE_MAX / sizeof(struct nfa_node))
+        if (new_n > SIZE_MAX / sizeof(size_t))
+            mgoto(error);
+
+        if ((t_type = realloc(ns->type, new_n)) == NULL)
+            mgoto(error);
+
+        ns->type = t_type;
+
+        if ((t = realloc(ns->link0, new_n * sizeof(size_t))) == NULL)
+            mgoto(error);
+
+        ns->link0 = t;
+
+        if ((t = realloc(ns->link1, new_n * sizeof(size_t))) == NULL)
             mgoto(error);
 
-        new_size_in_bytes = new_n * sizeof(struct nfa_node);
+        ns->link1 = t;
 
-        if ((t = realloc(ns->a, new_size_in_bytes)) == NULL)
+        if ((t = realloc(ns->cs, new_n * sizeof(size_t))) == NULL)
             mgoto(error);
 
-        ns->a = t;
+        ns->cs = t;
         ns->n = new_n;
     }
 
@@ -240,65 +441,39 @@ error:
     return 1;
 }
 
-static int delete_node(struct nfa_storage *ns, size_t node)
-{
-    /*
-     * A simple delete like this only works for nodes that are not referenced
-     * by other nodes (such as start nodes).
-     */
-    if (ns->i && node == ns->i - 1) {
-        ns->i--;
-        return 0;
-    }
-
-    /* There can only be one node marked for reuse at a time */
-    if (ns->reuse_set)
-        d_mreturn("Node reuse already set", 1);
-
-    ns->reuse = node;
-    ns->reuse_set = 1;
-
-    return 0;
-}
-
-static void fill_hole(
+static int compact_nfa(
     struct nfa_storage *ns, size_t *start_node, size_t *end_node)
 {
     /*
-     * Fills hole with the last node in the array, and patches the links.
-     * Updates start_node and end_node if they were the old last node.
+     * Removes the dead nodes in one pass, and patches the links.
+     * Dead nodes are never linked to, as they were start nodes.
      */
-    size_t old_node, i;
-
-    if (!ns->i) {
-        ns->reuse_set = 0;
-        return;
-    }
+    size_t *new_i, i, j;
 
-    if (!ns->reuse_set)
-        return;
+    if ((new_i = calloc(ns->i, sizeof(size_t))) == NULL)
+        mreturn(1);
 
-    old_node = ns->i - 1;
-    copy_node(ns->reuse, old_node);
-    --ns->i;
+    for (i = 0, j = 0; i < ns->i; ++i)
+        if (lk_type(i) != DEAD_NODE)
+            new_i[i] = j++;
 
-    /* Patch references */
-    for (i = 0; i < ns->i; ++i) {
-        if (lk(i).link0 == old_node)
-            lk(i).link0 = ns->reuse;
+    for (i = 0, j = 0; i < ns->i; ++i) {
+        if (lk_type(i) == DEAD_NODE)
+            continue;
 
-        if (lk(i).link1 == old_node)
-            lk(i).link1 = ns->reuse;
+        lk_type(j) = lk_type(i);
+        lk_link0(j) = new_i[lk_link0(i)];
+        lk_link1(j) = new_i[lk_link1(i)];
+        ns->cs[j] = ns->cs[i];
+        ++j;
     }
 
-    /* Update start and end nodes */
-    if (old_node == *start_node)
-        *start_node = ns->reuse;
+    *start_node = new_i[*start_node];
+    *end_node = new_i[*end_node];
+    ns->i = j;
 
-    if (old_node == *end_node)
-        *end_node = ns->reuse;
-
-    ns->reuse_set = 0;
+    free(new_i);
+    return 0;
 }
 
 static struct operand_stack *init_operand_stack(void)
@@ -379,1044 +554,3286 @@ static int pop_operand_stack(
     return 0;
 }
 
-static struct regex *init_regex(void)
+static struct sparse_set *init_sparse_set(size_t n)
 {
-    return calloc(1, sizeof(struct regex));
+    struct sparse_set *t = NULL;
+
+    if ((t = calloc(1, sizeof(struct sparse_set))) == NULL)
+        mgoto(error);
+
+    if (mof(n, sizeof(size_t), SIZE_MAX))
+        mgoto(error);
+
+    if ((t->dense = calloc(n, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    if ((t->sparse = calloc(n, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    return t;
+
+error:
+    if (t != NULL) {
+        free(t->dense);
+        free(t);
+    }
+    return NULL;
 }
 
-static void free_regex(struct regex *reg)
+static void free_sparse_set(struct sparse_set *z)
 {
-    if (reg != NULL) {
-        free(reg->find_esc);
-        free(reg->find_eof);
-        free_regex_chain(reg->ri);
-        free_nfa_storage(reg->ns);
-        free(reg->state);
-        free(reg->state_next);
-        free(reg);
+    if (z != NULL) {
+        free(z->dense);
+        free(z->sparse);
+        free(z);
     }
 }
 
-/* ********** Regex related functions ********** */
+#define in_set(z, x)                                                          \
+    ((z)->sparse[x] < (z)->i && (z)->dense[(z)->sparse[x]] == (x))
 
-static int interpret_escaped_chars(
-    const char *input_str, char **output, size_t *output_size)
-{
-    int ret = 0;
-    const char *p;
-    char *mem = NULL, *q, ch, c, h1, h0;
-    size_t len = strlen(input_str);
+#define add_to_set(z, x)                                                      \
+    do {                                                                      \
+        if (!in_set(z, x)) {                                                  \
+            (z)->sparse[x] = (z)->i;                                          \
+            (z)->dense[(z)->i++] = (x);                                       \
+        }                                                                     \
+    } while (0)
 
-    if ((mem = calloc(len + 1, 1)) == NULL)
-        mgoto(error);
+static void epsilon_closure(struct regex *reg, struct sparse_set *z, int sol,
+    int eol)
+{
+    /*
+     * Adds the nodes that can be reached from the members of z without
+     * reading a character. The set itself is used as the work queue.
+     */
+    struct nfa_storage *ns = reg->ns;
+    size_t j, x;
+
+    for (j = 0; j < z->i; ++j) {
+        x = z->dense[j];
+        switch (lk_type(x)) {
+        case BOTH_EPSILON:
+            add_to_set(z, lk_link1(x));
+            /* Fall through */
+        case EPSILON:
+            add_to_set(z, lk_link0(x));
+            break;
+        case SOL_READ_STATUS:
+            if (sol)
+                add_to_set(z, lk_link0(x));
 
-    p = input_str;
-    q = mem;
-    while ((ch = *p++) != '\0') {
-        if (ch == '\\')
-            switch ((c = *p++)) {
-            case '\0':
-                d_mgoto(syntax_error, "Incomplete escape sequence\n");
-                break;
-            case '0':
-                *q++ = '\0';
-                break;
-            case 'a':
-                *q++ = '\a';
-                break;
-            case 'b':
-                *q++ = '\b';
-                break;
-            case 't':
-                *q++ = '\t';
-                break;
-            case 'n':
-                *q++ = '\n';
-                break;
-            case 'v':
-                *q++ = '\v';
-                break;
-            case 'f':
-                *q++ = '\f';
-                break;
-            case 'r':
-                *q++ = '\r';
-                break;
-            case 'x':
-                if (isxdigit((h1 = *p++)) && isxdigit((h0 = *p++)))
-                    *q++ = hex(h1, h0);
-                else
-                    d_mgoto(syntax_error, "Invalid hex character\n");
+            break;
+        case EOL_READ_STATUS:
+            if (eol)
+                add_to_set(z, lk_link0(x));
 
-                break;
-            default:
-                *q++ = '\\';
-                *q++ = c;
-                break;
-            }
-        else
-            *q++ = ch;
+            break;
+        }
     }
-    *output_size = q - mem;
-    *output = mem;
-    return 0;
+}
 
-error:
-    ret = 1;
+/*
+ * Index of the closure of node x. The start node has an extra pair of
+ * closures for when the start of line read status is set, which only
+ * ever applies to the start node, as no other node can be in-state
+ * before the first character is read.
+ */
+#define cl_key(x, sol, eol)                                                   \
+    ((sol) && (x) == reg->nfa_start ? ns->i * 2 + (eol) : (x) * 2 + (eol))
 
-syntax_error:
-    if (!ret)
-        ret = SYNTAX_ERROR;
+static int build_closures(struct regex *reg)
+{
+    struct nfa_storage *ns = reg->ns;
+    struct sparse_set *z = reg->ss;
+    size_t num, k, j, x, n, *t;
 
-    free(mem);
-    return ret;
+    num = ns->i * 2 + 2;
+
+    if (mof(num + 1, sizeof(size_t), SIZE_MAX))
+        mreturn(1);
+
+    if ((reg->cl_off = calloc(num + 1, sizeof(size_t))) == NULL)
+        mreturn(1);
+
+    n = INIT_CLOSURE_POOL;
+    if ((reg->cl = calloc(n, sizeof(size_t))) == NULL)
+        mreturn(1);
+
+    for (k = 0; k < num; ++k) {
+        z->i = 0;
+        add_to_set(z, k < ns->i * 2 ? k / 2 : reg->nfa_start);
+        epsilon_closure(reg, z, k >= ns->i * 2, k % 2);
+
+        if (z->i > n - reg->cl_off[k]) {
+            /* Grow */
+            if (aof(reg->cl_off[k], z->i, SIZE_MAX / 2)
+                || mof(reg->cl_off[k] + z->i, 2 * sizeof(size_t), SIZE_MAX))
+                mreturn(1);
+
+            n = (reg->cl_off[k] + z->i) * 2;
+            if ((t = realloc(reg->cl, n * sizeof(size_t))) == NULL)
+                mreturn(1);
+
+            reg->cl = t;
+        }
+
+        reg->cl_off[k + 1] = reg->cl_off[k];
+        for (j = 0; j < z->i; ++j) {
+            x = z->dense[j];
+            if (lk_type(x) == CHAR_SET || x == reg->nfa_end)
+                reg->cl[reg->cl_off[k + 1]++] = x;
+        }
+    }
+
+    return 0;
 }
 
-static int char_to_int_eof_term(
-    const char *input, size_t input_size, int **output)
+static int build_rev_closures(struct regex *reg)
 {
-    /* EOF terminated */
-    int *imem = NULL;
-    const unsigned char *p;
-    size_t i;
+    /*
+     * Reverses the closures. When running backwards, the CHAR_SET node w
+     * leads to the CHAR_SET nodes that have w in the closure of their
+     * destination: rcl[rcl_off[w]] up to rcl[rcl_off[w + 1]]. Keys ns->i and
+     * ns->i + 1 are the CHAR_SET nodes that lead to the end node, by eol.
+     * Inside a match the read statuses are not set (the \n cannot be read in
+     * newline sensitive mode), so only the closures at the ends of the match
+     * depend on them.
+     */
+    struct nfa_storage *ns = reg->ns;
+    const size_t *c, *c_stop;
+    size_t num, w, k, eol, *fill = NULL;
+    int sol, pass;
 
-    p = (unsigned char *) input;
+    num = ns->i + 2;
 
-    if (input_size == SIZE_MAX)
-        mgoto(error);
+    if (mof(num + 1, sizeof(size_t), SIZE_MAX))
+        mreturn(1);
 
-    if ((imem = calloc(input_size + 1, sizeof(int))) == NULL)
+    if ((reg->rcl_off = calloc(num + 1, sizeof(size_t))) == NULL)
+        mreturn(1);
+
+    if ((fill = calloc(num, sizeof(size_t))) == NULL)
+        mreturn(1);
+
+    if ((reg->rev_start = calloc(ns->i, 1)) == NULL)
         mgoto(error);
 
-    for (i = 0; i < input_size; ++i) imem[i] = p[i];
+    /* Count, then fill */
+    for (pass = 0; pass < 2; ++pass) {
+        for (w = 0; w < ns->i; ++w) {
+            if (lk_type(w) != CHAR_SET)
+                continue;
+
+            for (eol = 0; eol < 2; ++eol) {
+                k = cl_key(lk_link0(w), 0, eol);
+                c = reg->cl + reg->cl_off[k];
+                c_stop = reg->cl + reg->cl_off[k + 1];
+                for (; c != c_stop; ++c) {
+                    if (*c == reg->nfa_end)
+                        k = ns->i + eol;
+                    else if (!eol)
+                        k = *c;
+                    else
+                        continue;
+
+                    if (pass)
+                        reg->rcl[reg->rcl_off[k] + fill[k]++] = w;
+                    else
+                        ++reg->rcl_off[k + 1];
+                }
+            }
+        }
 
-    imem[input_size] = EOF;
+        if (!pass) {
+            for (k = 0; k < num; ++k)
+                reg->rcl_off[k + 1] += reg->rcl_off[k];
 
-    *output = imem;
+            if ((reg->rcl = calloc(reg->rcl_off[num] ? reg->rcl_off[num] : 1,
+                     sizeof(size_t)))
+                == NULL)
+                mgoto(error);
+        }
+    }
+
+    for (sol = 0; sol < 2; ++sol) {
+        for (eol = 0; eol < 2; ++eol) {
+            k = cl_key(reg->nfa_start, sol, eol);
+            c = reg->cl + reg->cl_off[k];
+            c_stop = reg->cl + reg->cl_off[k + 1];
+            for (; c != c_stop; ++c) {
+                if (*c == reg->nfa_end)
+                    reg->rev_empty[sol][eol] = 1;
+                else if (!eol)
+                    reg->rev_start[*c] |= 1 << sol;
+            }
+        }
+    }
+
+    free(fill);
     return 0;
 
 error:
-    free(imem);
+    free(fill);
     return 1;
 }
 
-static void print_cs_ch(unsigned char u)
+static void add_closure(
+    struct regex *reg, struct sparse_set *z, size_t x, int sol, int eol)
 {
-    if (isgraph(u) && u != '-' && u != 'e' && u != '^' && u != '$')
-        putc(u, stderr);
-    else
-        fprintf(stderr, "\\x%02X", u);
+    struct nfa_storage *ns = reg->ns;
+    const size_t *c, *c_stop;
+    size_t k = cl_key(x, sol, eol);
+
+    c = reg->cl + reg->cl_off[k];
+    c_stop = reg->cl + reg->cl_off[k + 1];
+    while (c != c_stop) {
+        add_to_set(z, *c);
+        ++c;
+    }
 }
 
-static void print_char_set(const unsigned char *char_set)
+static int single_byte(const unsigned char *char_set, unsigned char *u)
 {
-    int i, in_range;
+    /* Returns 1 if the set has exactly one member, which is stored in u */
+    size_t j, count = 0;
 
-    if (char_set == NULL) {
-        fprintf(stderr, "NULL");
-        return;
+    for (j = 0; j <= UCHAR_MAX; ++j)
+        if (cs_test(char_set, j)) {
+            *u = (unsigned char) j;
+            ++count;
+        }
+
+    return count == 1;
+}
+
+static int is_required(struct regex *reg, size_t x)
+{
+    /* Checks if every path from the start node to the end node visits x */
+    struct nfa_storage *ns = reg->ns;
+    struct sparse_set *z = reg->ss;
+    size_t j, y;
+
+    z->i = 0;
+    add_to_set(z, reg->nfa_start);
+    for (j = 0; j < z->i; ++j) {
+        y = z->dense[j];
+        if (y == x || lk_type(y) == END_NODE)
+            continue;
+
+        add_to_set(z, lk_link0(y));
+        if (lk_type(y) == BOTH_EPSILON)
+            add_to_set(z, lk_link1(y));
     }
 
-    in_range = 0;
-    for (i = 0; i <= UCHAR_MAX; ++i)
-        if (!in_range && i && char_set[i - 1] && char_set[i] && i != UCHAR_MAX
-            && char_set[i + 1]) {
-            in_range = 1;
-            putc('-', stderr);
-        } else if (in_range && !char_set[i]) {
-            print_cs_ch(i - 1);
-            in_range = 0;
-        } else if (in_range && i == UCHAR_MAX && char_set[i]) {
-            print_cs_ch(i);
-            in_range = 0;
-        } else if (!in_range && char_set[i]) {
-            print_cs_ch(i);
-        }
+    return !in_set(z, reg->nfa_end);
 }
 
-static void print_regex_chain(const struct regex_item *ri_head)
+static size_t literal_chain(struct regex *reg, size_t x, unsigned char *lit)
 {
-    while (ri_head != NULL) {
-        if (ri_head->operator== NO_OPERATOR) {
-            fprintf(stderr, "Char set: ");
-            print_char_set(ri_head->char_set);
-            putc('\n', stderr);
-        } else {
-            fprintf(stderr, "Operator: %s\n",
-                    op_detail[ri_head->operator].str);
+    /*
+     * Follows the single byte CHAR_SET nodes, commencing at x, for as long
+     * as the next character read is forced. The bytes are stored in lit,
+     * which needs to be of size ns->i. Returns the length.
+     */
+    struct nfa_storage *ns = reg->ns;
+    const size_t *c;
+    size_t len = 0, k;
+
+    while (len < ns->i && lk_type(x) == CHAR_SET
+        && single_byte(lk_cs(x), lit + len)) {
+        ++len;
+        /* Superset of the states after reading the byte */
+        k = cl_key(lk_link0(x), 0, 1);
+        if (reg->cl_off[k + 1] - reg->cl_off[k] != 1)
+            break;
+
+        c = reg->cl + reg->cl_off[k];
+        if (*c == reg->nfa_end)
+            break;
+
+        x = *c;
+    }
+
+    return len;
+}
+
+static int build_prefilter(struct regex *reg)
+{
+    /*
+     * Works out, from the closures of the start node:
+     * If a match can only commence at the start of a line (anchored).
+     * The set of bytes that a match can commence with.
+     * A literal that every match commences with, and a literal that every
+     * match contains.
+     */
+    struct nfa_storage *ns = reg->ns;
+    const size_t *c, *c_stop;
+    unsigned char *lit = NULL;
+    size_t k, x, j, len;
+
+    /* Mid-line */
+    k = cl_key(reg->nfa_start, 0, 1);
+    reg->anchored = reg->cl_off[k + 1] == reg->cl_off[k];
+
+    /* All read statuses, which is the superset */
+    k = cl_key(reg->nfa_start, 1, 1);
+    c = reg->cl + reg->cl_off[k];
+    c_stop = reg->cl + reg->cl_off[k + 1];
+
+    reg->no_empty = 1;
+    for (; c != c_stop; ++c) {
+        if (*c == reg->nfa_end) {
+            reg->no_empty = 0;
+            break;
+        }
+        for (j = 0; j <= UCHAR_MAX; ++j)
+            if (cs_test(lk_cs(*c), j))
+                reg->first_set.in[j] = 1;
+    }
+
+    if (!reg->no_empty)
+        return 0;
+
+    init_byte_set(&reg->first_set);
+
+    if ((lit = malloc(ns->i)) == NULL)
+        mreturn(1);
+
+    if (reg->cl_off[k + 1] - reg->cl_off[k] == 1
+        && (len = literal_chain(reg, reg->cl[reg->cl_off[k]], lit))) {
+        if ((reg->prefix = malloc(len)) == NULL)
+            mgoto(error);
+
+        memcpy(reg->prefix, lit, len);
+        reg->prefix_len = len;
+    }
+
+    if (ns->i <= REQ_LIT_MAX_NODES) {
+        for (x = 0; x < ns->i; ++x) {
+            if (lk_type(x) == CHAR_SET && is_required(reg, x)
+                && (len = literal_chain(reg, x, lit)) > reg->req_len) {
+                free(reg->req);
+                if ((reg->req = malloc(len)) == NULL) {
+                    reg->req_len = 0;
+                    mgoto(error);
+                }
+                memcpy(reg->req, lit, len);
+                reg->req_len = len;
+            }
         }
-        ri_head = ri_head->next;
     }
+
+    free(lit);
+    return 0;
+
+error:
+    free(lit);
+    return 1;
 }
 
-static void add_to_char_set(unsigned char *char_set, int ch, int case_ins)
+static const char *prefilter(
+    struct regex *reg, const char *p, const char *p_stop)
 {
-    char_set[ch] = 1;
+    /*
+     * Skips to the first position, at or after p, where a match could
+     * commence. The start of line read status must be off at p.
+     */
+    const char *q;
 
-    if (case_ins) {
-        if (islower(ch))
-            char_set[ch - 'a' + 'A'] = 1;
-        else if (isupper(ch))
-            char_set[ch - 'A' + 'a'] = 1;
+    if (reg->anchored) {
+        if (reg->nl_ins)
+            return p_stop; /* Start of line is only at the start of text */
+
+        return (q = memchr(p, '\n', p_stop - p)) == NULL ? p_stop : q + 1;
     }
+
+    if (!reg->no_empty)
+        return p;
+
+    if (reg->prefix_len == 1)
+        q = memchr(p, *reg->prefix, p_stop - p);
+    else if (reg->prefix_len)
+        q = quick_search(p, p_stop - p, reg->prefix, reg->prefix_len);
+    else if (reg->first_set.num <= FIRST_BYTE_MAX)
+        q = scan_byte_set(&reg->first_set, p, p_stop);
+    else
+        q = p;
+
+    return q == NULL ? p_stop : q;
 }
 
-static int create_regex_chain(
-    const int *find_eof, struct regex_item **ri_head, int nl_ins, int case_ins)
+static unsigned long closure_mask(
+    struct regex *reg, size_t x, int sol, int eol, size_t *pos, int *end)
 {
-    int ret = 0;
-    const int *p;
-    int x, y, i;
-    struct regex_item *t, *ri = NULL;
-    struct regex_item *head = NULL, *prev = NULL;
-    int negate_set, first_ch_in_set;
+    /* Converts a closure into a mask of positions */
+    struct nfa_storage *ns = reg->ns;
+    const size_t *c, *c_stop;
+    unsigned long m = 0;
+
+    *end = 0;
+    c = reg->cl + reg->cl_off[cl_key(x, sol, eol)];
+    c_stop = reg->cl + reg->cl_off[cl_key(x, sol, eol) + 1];
+    for (; c != c_stop; ++c) {
+        if (*c == reg->nfa_end)
+            *end = 1;
+        else
+            m |= 1UL << pos[*c];
+    }
 
-    p = find_eof;
-    while ((x = *p++) != EOF) {
-        if ((t = init_regex_item()) == NULL)
-            mgoto(error);
+    return m;
+}
 
-        if (p == find_eof + 1) {
-            /* First node */
-            ri = t;
-            head = ri;
-        } else {
-            ri->next = t;
-            ri = t;
+static int build_bp(struct regex *reg)
+{
+    /*
+     * Builds the bit-parallel engine if the positions fit into a word.
+     * Returns 1 on error.
+     */
+    struct nfa_storage *ns = reg->ns;
+    size_t *pos = NULL, num_chunks, x, j, v;
+    unsigned long m, *fol = NULL, *t;
+    int end, sol, eol;
+
+    for (x = 0; x < ns->i; ++x)
+        if (lk_type(x) == CHAR_SET)
+            ++reg->bp_num;
+
+    if (reg->bp_num > BP_BITS)
+        return 0;
+
+    /* Position of each CHAR_SET node */
+    if ((pos = calloc(ns->i, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    /* At least one position, so that calloc is non-zero */
+    if ((fol = calloc(reg->bp_num + 1, sizeof(unsigned long))) == NULL)
+        mgoto(error);
+
+    num_chunks = (reg->bp_num + 7) / 8;
+    if (!num_chunks)
+        num_chunks = 1;
+
+    if ((reg->bp_follow = calloc(num_chunks * (UCHAR_MAX + 1),
+             sizeof(unsigned long)))
+        == NULL)
+        mgoto(error);
+
+    for (x = 0, j = 0; x < ns->i; ++x)
+        if (lk_type(x) == CHAR_SET)
+            pos[x] = j++;
+
+    for (x = 0; x < ns->i; ++x) {
+        if (lk_type(x) != CHAR_SET)
+            continue;
+
+        m = 1UL << pos[x];
+        for (v = 0; v <= UCHAR_MAX; ++v)
+            if (cs_test(lk_cs(x), v))
+                reg->bp_b[v] |= m;
+
+        /*
+         * The start of line read status is never set after a read, and the
+         * positions in-state only matter when not at the end of a line.
+         */
+        fol[pos[x]] = closure_mask(reg, lk_link0(x), 0, 0, pos, &end);
+        if (end)
+            reg->bp_final[0] |= m;
+
+        closure_mask(reg, lk_link0(x), 0, 1, pos, &end);
+        if (end)
+            reg->bp_final[1] |= m;
+    }
+
+    for (sol = 0; sol < 2; ++sol)
+        for (eol = 0; eol < 2; ++eol) {
+            m = closure_mask(reg, reg->nfa_start, sol, eol, pos, &end);
+            if (!eol)
+                reg->bp_start[sol] = m;
+
+            reg->bp_empty[sol][eol] = (unsigned char) end;
         }
 
-        if (x == '\\') {
-            if (*p == EOF)
-                d_mgoto(syntax_error, "Incomplete escape sequence\n");
+    /* Union tables. Each entry adds one follow set to an earlier entry. */
+    for (j = 0; j < num_chunks; ++j) {
+        t = reg->bp_follow + j * (UCHAR_MAX + 1);
+        for (v = 1; v <= UCHAR_MAX; ++v) {
+            for (x = 0; !(v & (1UL << x)); ++x)
+                ;
+
+            if (j * 8 + x < reg->bp_num)
+                t[v] = t[v & (v - 1)] | fol[j * 8 + x];
+            else
+                t[v] = t[v & (v - 1)];
+        }
+    }
 
-            if ((ri->char_set = calloc(UCHAR_MAX + 1, 1)) == NULL)
-                mgoto(error);
+    reg->bp = 1;
 
-            ri->operator= NO_OPERATOR;
-            ri->char_set[*p++] = 1;
-        } else if (x == '[') {
-            /* Character set */
-            if ((ri->char_set = calloc(UCHAR_MAX + 1, 1)) == NULL)
-                mgoto(error);
+    free(pos);
+    free(fol);
+    return 0;
 
-            ri->operator= NO_OPERATOR;
+error:
+    free(pos);
+    free(fol);
+    return 1;
+}
+
+static struct dfa *init_dfa(size_t row)
+{
+    struct dfa *t = NULL;
+    size_t i;
+
+    if ((t = calloc(1, sizeof(struct dfa))) == NULL)
+        mgoto(error);
+
+    t->row = row;
+
+    if ((t->st = calloc(INIT_DFA_STATES, sizeof(struct dfa_state))) == NULL)
+        mgoto(error);
+
+    if (mof(INIT_DFA_STATES, row * sizeof(size_t), SIZE_MAX))
+        mgoto(error);
+
+    if ((t->trans = malloc(INIT_DFA_STATES * row * sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    t->n = INIT_DFA_STATES;
+
+    if ((t->pool = calloc(INIT_DFA_POOL, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    t->pool_n = INIT_DFA_POOL;
+
+    /* Keep the load factor at or under a half */
+    if ((t->ht = calloc(INIT_DFA_STATES * 2, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    t->ht_n = INIT_DFA_STATES * 2;
+
+    for (i = 0; i < 2; ++i) t->start[i] = DFA_UNKNOWN;
+
+    return t;
+
+error:
+    if (t != NULL) {
+        free(t->st);
+        free(t->trans);
+        free(t->pool);
+        free(t);
+    }
+    return NULL;
+}
+
+static void free_dfa(struct dfa *d)
+{
+    if (d != NULL) {
+        free(d->st);
+        free(d->trans);
+        free(d->pool);
+        free(d->ht);
+        free(d);
+    }
+}
+
+static struct regex *init_regex(void)
+{
+    return calloc(1, sizeof(struct regex));
+}
+
+static void free_scratch(struct regex *reg)
+{
+    free(reg->state);
+    free(reg->state_next);
+    free_sparse_set(reg->ss);
+    free_sparse_set(reg->kern);
+    free_sparse_set(reg->rev_ss);
+    free_sparse_set(reg->rev_kern);
+    free_dfa(reg->dfa);
+}
+
+static int init_scratch(struct regex *reg, int dfa)
+{
+    /*
+     * Allocates the memory that a search writes to. The rest of a compiled
+     * regex is read-only, so a copy of the struct with its own scratch can
+     * search at the same time as the original.
+     */
+    size_t n = reg->ns->i;
+
+    reg->state = NULL;
+    reg->state_next = NULL;
+    reg->ss = NULL;
+    reg->kern = NULL;
+    reg->rev_ss = NULL;
+    reg->rev_kern = NULL;
+    reg->dfa = NULL;
+
+    if ((reg->state = calloc(n, sizeof(size_t))) == NULL)
+        mreturn(1);
+
+    if ((reg->state_next = calloc(n, sizeof(size_t))) == NULL)
+        mreturn(1);
+
+    if ((reg->ss = init_sparse_set(n)) == NULL)
+        mreturn(1);
+
+    if ((reg->kern = init_sparse_set(n)) == NULL)
+        mreturn(1);
+
+    if ((reg->rev_ss = init_sparse_set(n)) == NULL)
+        mreturn(1);
+
+    if ((reg->rev_kern = init_sparse_set(n)) == NULL)
+        mreturn(1);
+
+    if (dfa && (reg->dfa = init_dfa(reg->num_classes)) == NULL)
+        mreturn(1);
+
+    return 0;
+}
+
+void regex_free(struct regex *reg)
+{
+    if (reg != NULL) {
+        free(reg->find_esc);
+        free(reg->find_eof);
+        free_regex_chain(reg->ri);
+        free_nfa_storage(reg->ns);
+        free(reg->cl);
+        free(reg->cl_off);
+        free(reg->rcl);
+        free(reg->rcl_off);
+        free(reg->rev_start);
+        free(reg->prefix);
+        free(reg->req);
+        free(reg->bp_follow);
+        free(reg->cs_store);
+        free_scratch(reg);
+        free(reg);
+    }
+}
+
+/* ********** Regex related functions ********** */
+
+static int interpret_escaped_chars(
+    const char *input_str, char **output, size_t *output_size)
+{
+    int ret = 0;
+    const char *p;
+    char *mem = NULL, *q, ch, c, h1, h0;
+    size_t len = strlen(input_str);
+
+    if ((mem = calloc(len + 1, 1)) == NULL)
+        mgoto(error);
+
+    p = input_str;
+    q = mem;
+    while ((ch = *p++) != '\0') {
+        if (ch == '\\')
+            switch ((c = *p++)) {
+            case '\0':
+                d_mgoto(syntax_error, "Incomplete escape sequence\n");
+                break;
+            case '0':
+                *q++ = '\0';
+                break;
+            case 'a':
+                *q++ = '\a';
+                break;
+            case 'b':
+                *q++ = '\b';
+                break;
+            case 't':
+                *q++ = '\t';
+                break;
+            case 'n':
+                *q++ = '\n';
+                break;
+            case 'v':
+                *q++ = '\v';
+                break;
+            case 'f':
+                *q++ = '\f';
+                break;
+            case 'r':
+                *q++ = '\r';
+                break;
+            case 'x':
+                if (isxdigit((h1 = *p++)) && isxdigit((h0 = *p++)))
+                    *q++ = hex(h1, h0);
+                else
+                    d_mgoto(syntax_error, "Invalid hex character\n");
+
+                break;
+            default:
+                *q++ = '\\';
+                *q++ = c;
+                break;
+            }
+        else
+            *q++ = ch;
+    }
+    *output_size = q - mem;
+    *output = mem;
+    return 0;
+
+error:
+    ret = 1;
+
+syntax_error:
+    if (!ret)
+        ret = SYNTAX_ERROR;
+
+    free(mem);
+    return ret;
+}
+
+static int char_to_int_eof_term(
+    const char *input, size_t input_size, int **output)
+{
+    /* EOF terminated */
+    int *imem = NULL;
+    const unsigned char *p;
+    size_t i;
+
+    p = (unsigned char *) input;
+
+    if (input_size == SIZE_MAX)
+        mgoto(error);
+
+    if ((imem = calloc(input_size + 1, sizeof(int))) == NULL)
+        mgoto(error);
+
+    for (i = 0; i < input_size; ++i) imem[i] = p[i];
+
+    imem[input_size] = EOF;
+
+    *output = imem;
+    return 0;
+
+error:
+    free(imem);
+    return 1;
+}
+
+static void print_cs_ch(unsigned char u)
+{
+    if (isgraph(u) && u != '-' && u != 'e' && u != '^' && u != '$')
+        putc(u, stderr);
+    else
+        fprintf(stderr, "\\x%02X", u);
+}
+
+static void print_char_set(const unsigned char *char_set)
+{
+    int i, in_range;
+
+    if (char_set == NULL) {
+        fprintf(stderr, "NULL");
+        return;
+    }
+
+    in_range = 0;
+    for (i = 0; i <= UCHAR_MAX; ++i)
+        if (!in_range && i && cs_test(char_set, i - 1)
+            && cs_test(char_set, i) && i != UCHAR_MAX
+            && cs_test(char_set, i + 1)) {
+            in_range = 1;
+            putc('-', stderr);
+        } else if (in_range && !cs_test(char_set, i)) {
+            print_cs_ch(i - 1);
+            in_range = 0;
+        } else if (in_range && i == UCHAR_MAX && cs_test(char_set, i)) {
+            print_cs_ch(i);
+            in_range = 0;
+        } else if (!in_range && cs_test(char_set, i)) {
+            print_cs_ch(i);
+        }
+}
+
+static void print_regex_chain(const struct regex_item *ri_head)
+{
+    while (ri_head != NULL) {
+        if (ri_head->operator== NO_OPERATOR) {
+            fprintf(stderr, "Char set: ");
+            print_char_set(ri_head->char_set);
+            putc('\n', stderr);
+        } else {
+            fprintf(stderr, "Operator: %s\n",
+                    op_detail[ri_head->operator].str);
+        }
+        ri_head = ri_head->next;
+    }
+}
+
+static void add_to_char_set(unsigned char *char_set, int ch, int case_ins)
+{
+    cs_set(char_set, ch);
+
+    if (case_ins) {
+        if (islower(ch))
+            cs_set(char_set, ch - 'a' + 'A');
+        else if (isupper(ch))
+            cs_set(char_set, ch - 'A' + 'a');
+    }
+}
+
+static int create_regex_chain(
+    const int *find_eof, struct regex_item **ri_head, int nl_ins, int case_ins)
+{
+    int ret = 0;
+    const int *p;
+    int x, y, i;
+    struct regex_item *t, *ri = NULL;
+    struct regex_item *head = NULL, *prev = NULL;
+    int negate_set, first_ch_in_set;
+
+    p = find_eof;
+    while ((x = *p++) != EOF) {
+        if ((t = init_regex_item()) == NULL)
+            mgoto(error);
+
+        if (p == find_eof + 1) {
+            /* First node */
+            ri = t;
+            head = ri;
+        } else {
+            ri->next = t;
+            ri = t;
+        }
+
+        if (x == '\\') {
+            if (*p == EOF)
+                d_mgoto(syntax_error, "Incomplete escape sequence\n");
+
+            ri->operator= NO_OPERATOR;
+            cs_set(ri->char_set, *p);
+            ++p;
+        } else if (x == '[') {
+            /* Character set */
+            ri->operator= NO_OPERATOR;
+
+            negate_set = 0;
+
+            if (*p == '^') {
+                negate_set = 1;
+                ++p;
+            }
+
+            first_ch_in_set = 1;
+
+            while (1) {
+                /* Check for range */
+                if ((first_ch_in_set || (*p != ']' && *p != EOF))
+                    && *(p + 1) == '-' && *(p + 2) != ']' && *(p + 2) != EOF) {
+                    if (*p > *(p + 2))
+                        d_mgoto(syntax_error, "Descending range\n");
+
+                    for (y = *p; y <= *(p + 2); ++y)
+                        add_to_char_set(ri->char_set, y, case_ins);
+
+                    p += 2;
+                } else if (*p == ']' && !first_ch_in_set) {
+                    ++p;
+                    break; /* End of set */
+                } else if (*p == EOF) {
+                    d_mgoto(syntax_error, "Unclosed character set\n");
+                } else {
+                    add_to_char_set(ri->char_set, *p, case_ins);
+                }
+                first_ch_in_set = 0;
+                ++p;
+            }
+
+            if (negate_set)
+                for (i = 0; i < CS_SIZE; ++i)
+                    ri->char_set[i] = (unsigned char) ~ri->char_set[i];
+        } else {
+            /* Operators and other characters */
+            switch (x) {
+                /* Operators */
+            case '(':
+                ri->operator= LEFT_PAREN;
+                break;
+            case ')':
+                ri->operator= RIGHT_PAREN;
+                break;
+            case '+':
+                ri->operator= ONE_OR_MORE;
+                break;
+            case '?':
+                ri->operator= ZERO_OR_ONE;
+                break;
+            case '*':
+                ri->operator= ZERO_OR_MORE;
+                break;
+            case '^':
+                ri->operator= SOL_ANCHOR;
+                break;
+            case '$':
+                ri->operator= EOL_ANCHOR;
+                break;
+            case '|':
+                ri->operator= OR;
+                break;
+            default:
+                /* Other characters */
+                ri->operator= NO_OPERATOR;
+
+                if (x == '.') {
+                    /* Set of all chars */
+                    memset(ri->char_set, 0xFF, CS_SIZE);
+
+                    if (!nl_ins)
+                        cs_clear(ri->char_set, '\n');
+                } else {
+                    add_to_char_set(ri->char_set, x, case_ins);
+                }
+
+                break;
+            }
+        }
+        if ((ri->operator== NO_OPERATOR || ri->operator== LEFT_PAREN || ri->
+                operator== SOL_ANCHOR)
+            && prev != NULL
+            && (prev->
+                operator== NO_OPERATOR || prev->
+                operator== ONE_OR_MORE || prev->
+                operator== ZERO_OR_ONE || prev->
+                operator== ZERO_OR_MORE || prev->
+                operator== RIGHT_PAREN || prev->operator== EOL_ANCHOR)) {
+            /* Link in concatenation */
+            if ((t = init_regex_item()) == NULL)
+                mgoto(error);
+
+            t->operator= CONCAT;
+
+            prev->next = t;
+            t->next = ri;
+        }
+
+        prev = ri;
+    }
+
+    *ri_head = head;
+
+    return 0;
+
+error:
+    ret = 1;
+
+syntax_error:
+    if (!ret)
+        ret = SYNTAX_ERROR;
+
+    free_regex_chain(head);
+    return ret;
+}
+
+#define pop_operator_to_output                                                \
+    do {                                                                      \
+        if (output_tail == NULL) {                                            \
+            output_tail = operator_stack;                                     \
+            postfix = output_tail;                                            \
+        } else {                                                              \
+            output_tail->next = operator_stack;                               \
+            output_tail = output_tail->next;                                  \
+        }                                                                     \
+        operator_stack = operator_stack->next;                                \
+    } while (0)
+
+static void shunting_yard(struct regex_item **ri_head)
+{
+    struct regex_item *operator_stack = NULL;
+    struct regex_item *postfix = NULL; /* Output head */
+    struct regex_item *output_tail = NULL;
+    struct regex_item *next = NULL;
+    struct regex_item *ri, *t;
+
+    ri = *ri_head;
+    while (ri != NULL) {
+        next = ri->next; /* Backup */
+        if (ri->operator== NO_OPERATOR) {
+            if (output_tail == NULL) {
+                output_tail = ri;
+                postfix = output_tail;
+            } else {
+                output_tail->next = ri;
+                output_tail = ri;
+            }
+        } else if (ri->operator== LEFT_PAREN) {
+            ri->next = operator_stack;
+            operator_stack = ri;
+        } else if (ri->operator== RIGHT_PAREN) {
+            while (operator_stack != NULL) {
+                if (operator_stack->operator== LEFT_PAREN) {
+                    t = operator_stack;
+                    operator_stack = operator_stack->next;
+                    /* Need to free left parenthesis, as removed */
+                    t->next = NULL; /* Isolate */
+                    free_regex_chain(t);
+                    break;
+                } else {
+                    pop_operator_to_output;
+                }
+            }
+            /* Need to free right parenthesis, as removed */
+            /* Isolate. next has already been backed up above. */
+            ri->next = NULL;
+            free_regex_chain(ri);
+        } else {
+            while (operator_stack != NULL) {
+                if (operator_stack->operator == LEFT_PAREN
+                    || (op_detail[ri->operator].associativity == 'L'
+                        && op_detail[operator_stack->operator].precedence
+                        < op_detail[ri->operator].precedence)
+                    || (op_detail[ri->operator].associativity == 'R'
+                        && op_detail[operator_stack->operator].precedence
+                        <= op_detail[ri->operator].precedence)) {
+                    break;
+                } else {
+                    pop_operator_to_output;
+                }
+            }
+            ri->next = operator_stack;
+            operator_stack = ri;
+        }
+        ri = next; /* Restore from backup */
+    }
+    while (operator_stack != NULL) pop_operator_to_output;
+
+    if (output_tail != NULL)
+        output_tail->next = NULL;
+
+    *ri_head = postfix;
+}
+
+#undef pop_operator_to_output
+
+static int dedup_char_sets(struct regex *reg)
+{
+    /*
+     * Copies the distinct char sets of the regex chain into one block of
+     * memory, so that identical sets are shared. Then works out the byte
+     * classes, which are ranges of bytes that no char set splits.
+     */
+    struct regex_item *ri;
+    size_t num = 0, *ht = NULL, ht_n, h, j, k;
+    unsigned char boundary[UCHAR_MAX + 1];
+    const unsigned char *cs;
+    int u;
+
+    for (ri = reg->ri; ri != NULL; ri = ri->next)
+        if (ri->operator== NO_OPERATOR)
+            ++num;
+
+    if (mof(num + 1, CS_SIZE, SIZE_MAX) || num > SIZE_MAX / 4)
+        mgoto(error);
+
+    /* Hash table of set index plus one. Load factor of a half or less. */
+    for (ht_n = 1; ht_n < num * 2; ht_n *= 2)
+        ;
+
+    if ((ht = calloc(ht_n, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    if ((reg->cs_store = malloc((num + 1) * CS_SIZE)) == NULL)
+        mgoto(error);
+
+    for (ri = reg->ri; ri != NULL; ri = ri->next) {
+        if (ri->operator!= NO_OPERATOR)
+            continue;
+
+        /* djb2 */
+        h = 5381;
+        for (j = 0; j < CS_SIZE; ++j) h = h * 33 ^ ri->char_set[j];
+
+        h &= ht_n - 1;
+        while ((k = ht[h])
+            && memcmp(reg->cs_store + (k - 1) * CS_SIZE, ri->char_set,
+                CS_SIZE))
+            h = (h + 1) & (ht_n - 1);
+
+        if (!k) {
+            memcpy(reg->cs_store + reg->cs_num * CS_SIZE, ri->char_set,
+                CS_SIZE);
+            k = ++reg->cs_num;
+            ht[h] = k;
+        }
+        ri->cs = k - 1;
+    }
+
+    free(ht);
+    ht = NULL;
+
+    memset(boundary, '\0', UCHAR_MAX + 1);
+    for (j = 0; j < reg->cs_num; ++j) {
+        cs = reg->cs_store + j * CS_SIZE;
+        for (u = 1; u <= UCHAR_MAX; ++u)
+            if (!cs_test(cs, u) != !cs_test(cs, u - 1))
+                boundary[u] = 1;
+    }
+
+    /* \n needs a class of its own, as it is handled specially */
+    if (!reg->nl_ins) {
+        boundary['\n'] = 1;
+        boundary['\n' + 1] = 1;
+    }
+
+    k = 0;
+    for (u = 0; u <= UCHAR_MAX; ++u) {
+        if (boundary[u])
+            ++k;
+
+        reg->byte_class[u] = (unsigned char) k;
+    }
+    reg->num_classes = k + 1;
+
+    return 0;
+
+error:
+    free(ht);
+    return 1;
+}
+
+static int thompsons_construction(const struct regex_item *ri_head,
+    const unsigned char *cs_store, struct nfa_storage **nfa_store,
+    size_t *nfa_start, size_t *nfa_end)
+{
+    int ret = 0;
+    struct nfa_storage *ns = NULL;
+    struct operand_stack *z = NULL;
+    const struct regex_item *ri;
+    size_t start_a, end_a, start_b, end_b, start_c, end_c;
+
+    if ((ns = init_nfa_storage(cs_store)) == NULL)
+        mgoto(error);
+
+    if ((z = init_operand_stack()) == NULL)
+        mgoto(error);
+
+    ri = ri_head;
+    while (ri != NULL) {
+        switch (ri->operator) {
+        case NO_OPERATOR:
+            if (issue_node(ns, &start_c))
+                mgoto(error);
+
+            if (issue_node(ns, &end_c))
+                mgoto(error);
+
+            lk_link0(start_c) = end_c;
+            lk_type(start_c) = CHAR_SET;
+            ns->cs[start_c] = ri->cs;
+
+            if (push_operand_stack(z, start_c, end_c))
+                mgoto(error);
+
+            break;
+        case LEFT_PAREN:
+        case RIGHT_PAREN:
+            d_mgoto(syntax_error, "Parenthesis in postfix form\n");
+            break;
+        case ONE_OR_MORE:
+            if (pop_operand_stack(z, &start_b, &end_b))
+                mgoto(error);
+
+            /*
+             * New start node, as start_b is now linked to, and so
+             * cannot be merged away by concatenation.
+             */
+            if (issue_node(ns, &start_c))
+                mgoto(error);
+
+            lk_link0(start_c) = start_b;
+            lk_type(start_c) = EPSILON;
+
+            /* Loop-back */
+            lk_link0(end_b) = start_b;
+
+            /* New end node */
+            if (issue_node(ns, &end_c))
+                mgoto(error);
+
+            lk_link1(end_b) = end_c;
+            lk_type(end_b) = BOTH_EPSILON;
+
+            if (push_operand_stack(z, start_c, end_c))
+                mgoto(error);
+
+            break;
+        case ZERO_OR_ONE:
+            if (pop_operand_stack(z, &start_b, &end_b))
+                mgoto(error);
+
+            /* New start node */
+            if (issue_node(ns, &start_c))
+                mgoto(error);
+
+            /* New end node */
+            if (issue_node(ns, &end_c))
+                mgoto(error);
+
+            /* Link in new nodes */
+            lk_link0(start_c) = start_b;
+            lk_link0(end_b) = end_c;
+            lk_type(end_b) = EPSILON;
+
+            /* Bypass */
+            lk_link1(start_c) = end_c;
+
+            lk_type(start_c) = BOTH_EPSILON;
+
+            if (push_operand_stack(z, start_c, end_c))
+                mgoto(error);
+
+            break;
+        case ZERO_OR_MORE:
+            if (pop_operand_stack(z, &start_b, &end_b))
+                mgoto(error);
+
+            /* New start node */
+            if (issue_node(ns, &start_c))
+                mgoto(error);
+
+            /* New end node */
+            if (issue_node(ns, &end_c))
+                mgoto(error);
+
+            /* Loop-back */
+            lk_link0(end_b) = start_b;
+
+            /* Link in new nodes */
+            lk_link0(start_c) = start_b;
+            lk_link1(end_b) = end_c;
+
+            /* Bypass */
+            lk_link1(start_c) = end_c;
+
+            lk_type(start_c) = BOTH_EPSILON;
+            lk_type(end_b) = BOTH_EPSILON;
+
+            if (push_operand_stack(z, start_c, end_c))
+                mgoto(error);
+
+            break;
+        case CONCAT:
+            if (pop_operand_stack(z, &start_b, &end_b))
+                mgoto(error);
+
+            if (pop_operand_stack(z, &start_a, &end_a))
+                mgoto(error);
+
+            /* Merge the start of b into the end of a */
+            copy_node(end_a, start_b);
+
+            /*
+             * Only concatenation removes a node.
+             * OK, as start nodes are not referenced by other nodes.
+             */
+            lk_type(start_b) = DEAD_NODE;
+
+            if (push_operand_stack(z, start_a, end_b))
+                mgoto(error);
+
+            break;
+        case SOL_ANCHOR:
+            if (z->i) {
+                if (pop_operand_stack(z, &start_b, &end_b))
+                    mgoto(error);
+
+                /* New start node */
+                if (issue_node(ns, &start_c))
+                    mgoto(error);
+
+                /* Link in */
+                lk_link0(start_c) = start_b;
+                lk_type(start_c) = SOL_READ_STATUS;
+
+                if (push_operand_stack(z, start_c, end_b))
+                    mgoto(error);
+            } else {
+                /* ^ is a valid regex by itself */
+                if (issue_node(ns, &start_c))
+                    mgoto(error);
+
+                if (issue_node(ns, &end_c))
+                    mgoto(error);
+
+                lk_link0(start_c) = end_c;
+                lk_type(start_c) = SOL_READ_STATUS;
+
+                if (push_operand_stack(z, start_c, end_c))
+                    mgoto(error);
+            }
+
+            break;
+        case EOL_ANCHOR:
+            if (z->i) {
+                if (pop_operand_stack(z, &start_b, &end_b))
+                    mgoto(error);
+
+                /* New end node */
+                if (issue_node(ns, &end_c))
+                    mgoto(error);
+
+                lk_link0(end_b) = end_c;
+                lk_type(end_b) = EOL_READ_STATUS;
+
+                if (push_operand_stack(z, start_b, end_c))
+                    mgoto(error);
+            } else {
+                /* $ is a valid regex by itself */
+                if (issue_node(ns, &start_c))
+                    mgoto(error);
+
+                if (issue_node(ns, &end_c))
+                    mgoto(error);
+
+                lk_link0(start_c) = end_c;
+                lk_type(start_c) = EOL_READ_STATUS;
+
+                if (push_operand_stack(z, start_c, end_c))
+                    mgoto(error);
+            }
+
+            break;
+        case OR:
+            if (pop_operand_stack(z, &start_b, &end_b))
+                mgoto(error);
+
+            if (pop_operand_stack(z, &start_a, &end_a))
+                mgoto(error);
+
+            /* New start node */
+            if (issue_node(ns, &start_c))
+                mgoto(error);
+
+            /* New end node */
+            if (issue_node(ns, &end_c))
+                mgoto(error);
+
+            /* Branch start */
+            lk_link0(start_c) = start_a;
+            lk_link1(start_c) = start_b;
+            lk_type(start_c) = BOTH_EPSILON;
+
+            /* Connect end */
+            lk_link0(end_a) = end_c;
+            lk_type(end_a) = EPSILON;
+
+            lk_link0(end_b) = end_c;
+            lk_type(end_b) = EPSILON;
+
+            if (push_operand_stack(z, start_c, end_c))
+                mgoto(error);
+
+            break;
+        }
+
+        ri = ri->next;
+    }
+
+    if (pop_operand_stack(z, &start_b, &end_b))
+        d_mgoto(error, "No NFA generated\n");
+
+    if (z->i)
+        d_mgoto(syntax_error, "%lu operands left on the stack\n",
+            (unsigned long) z->i);
+
+    if (compact_nfa(ns, &start_b, &end_b))
+        mgoto(error);
+
+    *nfa_start = start_b;
+    *nfa_end = end_b;
+    *nfa_store = ns;
+    free_operand_stack(z);
+
+    return 0;
+
+error:
+    ret = 1;
+
+syntax_error:
+    if (!ret)
+        ret = SYNTAX_ERROR;
+
+    free_nfa_storage(ns);
+    free_operand_stack(z);
+    return ret;
+}
+
+static void print_nfa(struct nfa_storage *ns)
+{
+    size_t i;
+    for (i = 0; i < ns->i; ++i) {
+        if (lk_type(i) != END_NODE) {
+            fprintf(stderr, "%lu -- ", (unsigned long) i);
+            switch (lk_type(i)) {
+            case BOTH_EPSILON:
+            case EPSILON:
+                putc('e', stderr);
+                break;
+            case SOL_READ_STATUS:
+                putc('^', stderr);
+                break;
+            case EOL_READ_STATUS:
+                putc('$', stderr);
+                break;
+            case CHAR_SET:
+                print_char_set(lk_cs(i));
+                break;
+            }
+            fprintf(stderr, " --> %lu\n", (unsigned long) lk_link0(i));
+
+            if (lk_type(i) == BOTH_EPSILON)
+                fprintf(stderr, "%lu -- e --> %lu\n", (unsigned long) i,
+                    (unsigned long) lk_link1(i));
+        }
+    }
+}
+
+int regex_compile(const char *regex_str, int nl_ins, int case_ins,
+    struct regex **regex_st, int verbose)
+{
+    /*
+     * Compiles a regex into a handle that can be used for any number of
+     * searches. Free the handle with regex_free.
+     */
+    int ret = 1;
+    struct regex *reg = NULL;
+
+    if (regex_str == NULL || *regex_str == '\0')
+        d_mgoto(usage_error, "NULL or empty regex string\n");
+
+    if ((reg = init_regex()) == NULL)
+        mgoto(error);
+
+    reg->nl_ins = nl_ins;
+    reg->stats = stats_sink;
+
+    if ((ret = interpret_escaped_chars(
+             regex_str, &reg->find_esc, &reg->find_esc_size)))
+        mgoto(error);
+
+    if ((ret = char_to_int_eof_term(
+             reg->find_esc, reg->find_esc_size, &reg->find_eof)))
+        mgoto(error);
+
+    if ((ret = create_regex_chain(
+             reg->find_eof, &reg->ri, reg->nl_ins, case_ins)))
+        mgoto(error);
+
+    if (verbose) {
+        fprintf(stderr, "Infix:\n");
+        print_regex_chain(reg->ri);
+    }
+
+    if ((ret = dedup_char_sets(reg)))
+        mgoto(error);
+
+    if (verbose)
+        fprintf(stderr, "Distinct char sets: %lu\nByte classes: %lu\n",
+            (unsigned long) reg->cs_num, (unsigned long) reg->num_classes);
+
+    shunting_yard(&reg->ri);
+
+    if (verbose) {
+        fprintf(stderr, "Postfix:\n");
+        print_regex_chain(reg->ri);
+    }
+
+    if ((ret = thompsons_construction(reg->ri, reg->cs_store, &reg->ns,
+             &reg->nfa_start, &reg->nfa_end)))
+        mgoto(error);
+
+    if (verbose) {
+        fprintf(stderr, "NFA:\n");
+        print_nfa(reg->ns);
+    }
+
+    ret = 1;
+
+    /* The DFA is added once it is known if it is needed */
+    if (init_scratch(reg, 0))
+        mgoto(error);
+
+    if (build_closures(reg))
+        mgoto(error);
+
+    if (build_rev_closures(reg))
+        mgoto(error);
+
+    if (build_prefilter(reg))
+        mgoto(error);
+
+    if (verbose)
+        fprintf(stderr,
+            "Prefilter: anchored: %d, first bytes: %lu, prefix: %.*s, "
+            "required: %.*s\n",
+            reg->anchored, (unsigned long) reg->first_set.num,
+            (int) reg->prefix_len,
+            reg->prefix_len ? (char *) reg->prefix : "", (int) reg->req_len,
+            reg->req_len ? (char *) reg->req : "");
+
+    if (build_bp(reg))
+        mgoto(error);
+
+    if (!reg->bp && dfa_mem_limit
+        && (reg->dfa = init_dfa(reg->num_classes)) == NULL)
+        mgoto(error);
+
+    *regex_st = reg;
+    return 0;
+
+usage_error:
+    ret = USAGE_ERROR;
+
+error:
+    if (reg != NULL)
+        regex_free(reg);
+
+    return ret;
+}
+
+static int write_table(FILE *fp, const char *name, const char *field,
+    int type, const void *a, size_t n)
+{
+    /*
+     * Writes one array of the tables as C. type is 0 for unsigned char, 1
+     * for size_t, and 2 for unsigned long. An empty array gets one zero.
+     */
+    static const char *type_str[] = { "unsigned char", "size_t",
+        "unsigned long" };
+    char num[NUM_BUF_SIZE];
+    size_t j, col, v;
+    int w;
+
+    if (fprintf(fp, "static const %s %s_%s[] = {", type_str[type], name,
+            field)
+        < 0)
+        return 1;
+
+    col = 79; /* Start a new line */
+    for (j = 0; j < (n ? n : 1); ++j) {
+        if (!n)
+            v = 0;
+        else if (type == 0)
+            v = ((const unsigned char *) a)[j];
+        else if (type == 1)
+            v = ((const size_t *) a)[j];
+        else
+            v = ((const unsigned long *) a)[j];
+
+        if (v > ULONG_MAX)
+            return 1;
+
+        w = snprintf(num, NUM_BUF_SIZE, " %lu%s,", (unsigned long) v,
+            type == 2 ? "UL" : "");
+        if (w < 0 || w >= NUM_BUF_SIZE)
+            return 1;
+
+        if (col + w > 79) {
+            if (fprintf(fp, "\n   ") < 0)
+                return 1;
+
+            col = 3;
+        }
+
+        if (fputs(num, fp) == EOF)
+            return 1;
+
+        col += w;
+    }
+
+    if (fprintf(fp, "\n};\n\n") < 0)
+        return 1;
+
+    return 0;
+}
+
+int regex_write_tables(struct regex *reg, const char *name, FILE *fp)
+{
+    /*
+     * Writes the compiled regex as C source: one array per table and a
+     * struct regex_tables called name that refers to them. See regex_load.
+     */
+    struct nfa_storage *ns = reg->ns;
+    size_t num = ns->i * 2 + 2, rnum = ns->i + 2, bp_follow_num = 0;
+
+    if (reg->bp) {
+        bp_follow_num = (reg->bp_num + 7) / 8;
+        bp_follow_num = (bp_follow_num ? bp_follow_num : 1) * (UCHAR_MAX + 1);
+    }
+
+    if (write_table(fp, name, "type", 0, ns->type, ns->i)
+        || write_table(fp, name, "link0", 1, ns->link0, ns->i)
+        || write_table(fp, name, "link1", 1, ns->link1, ns->i)
+        || write_table(fp, name, "cs", 1, ns->cs, ns->i)
+        || write_table(
+            fp, name, "cs_store", 0, reg->cs_store, reg->cs_num * CS_SIZE)
+        || write_table(
+            fp, name, "byte_class", 0, reg->byte_class, UCHAR_MAX + 1)
+        || write_table(fp, name, "cl", 1, reg->cl, reg->cl_off[num])
+        || write_table(fp, name, "cl_off", 1, reg->cl_off, num + 1)
+        || write_table(fp, name, "rcl", 1, reg->rcl, reg->rcl_off[rnum])
+        || write_table(fp, name, "rcl_off", 1, reg->rcl_off, rnum + 1)
+        || write_table(fp, name, "rev_start", 0, reg->rev_start, ns->i)
+        || write_table(
+            fp, name, "first", 0, reg->first_set.in, UCHAR_MAX + 1)
+        || write_table(fp, name, "prefix", 0, reg->prefix, reg->prefix_len)
+        || write_table(fp, name, "req", 0, reg->req, reg->req_len)
+        || write_table(fp, name, "bp_b", 2, reg->bp_b, UCHAR_MAX + 1)
+        || write_table(
+            fp, name, "bp_follow", 2, reg->bp_follow, bp_follow_num))
+        mreturn(1);
+
+    if (fprintf(fp,
+            "const struct regex_tables %s = { %d, %d, %lu,\n"
+            "    %s_type, %s_link0, %s_link1, %s_cs, %lu, %s_cs_store,\n"
+            "    %s_byte_class, %lu, %lu, %lu, %s_cl, %s_cl_off, %s_rcl,\n"
+            "    %s_rcl_off, %s_rev_start, { { %d, %d }, { %d, %d } },\n"
+            "    %d, %d, %s_first, %s_prefix, %lu, %s_req, %lu,\n"
+            "    %d, %lu, %s_bp_b, %s_bp_follow, %lu, { %luUL, %luUL },\n"
+            "    { %luUL, %luUL }, { { %d, %d }, { %d, %d } } };\n",
+            name, REGEX_TABLES_VERSION, reg->nl_ins, (unsigned long) ns->i,
+            name, name, name, name, (unsigned long) reg->cs_num, name, name,
+            (unsigned long) reg->num_classes, (unsigned long) reg->nfa_start,
+            (unsigned long) reg->nfa_end, name, name, name, name, name,
+            reg->rev_empty[0][0], reg->rev_empty[0][1], reg->rev_empty[1][0],
+            reg->rev_empty[1][1], reg->anchored, reg->no_empty, name, name,
+            (unsigned long) reg->prefix_len, name,
+            (unsigned long) reg->req_len, reg->bp,
+            (unsigned long) reg->bp_num, name, name,
+            (unsigned long) bp_follow_num, reg->bp_start[0],
+            reg->bp_start[1], reg->bp_final[0], reg->bp_final[1],
+            reg->bp_empty[0][0], reg->bp_empty[0][1], reg->bp_empty[1][0],
+            reg->bp_empty[1][1])
+        < 0)
+        mreturn(1);
+
+    return 0;
+}
+
+static void *copy_table(const void *a, size_t n, size_t size)
+{
+    /* Heap copy of n elements. Never zero-sized. */
+    void *t;
+
+    if (mof(n, size, SIZE_MAX))
+        return NULL;
+
+    if ((t = malloc(n ? n * size : 1)) == NULL)
+        return NULL;
+
+    if (n)
+        memcpy(t, a, n * size);
+
+    return t;
+}
+
+int regex_load(const struct regex_tables *t, struct regex **regex_st)
+{
+    /*
+     * Makes a handle from tables written by regex_write_tables, with no
+     * compiling. The tables are copied, and the handle is then the same as
+     * one from regex_compile. Free it with regex_free.
+     */
+    int ret = 1;
+    struct regex *reg = NULL;
+    struct nfa_storage *ns;
+    size_t n = t->node_num, num = n * 2 + 2, rnum = n + 2;
+
+    if (t->version != REGEX_TABLES_VERSION || (t->bp && t->bp_num > BP_BITS))
+        d_mgoto(usage_error, "Incompatible regex tables\n");
+
+    if ((reg = init_regex()) == NULL)
+        mgoto(error);
+
+    reg->nl_ins = t->nl_ins;
+    reg->stats = stats_sink;
+
+    if ((reg->cs_store = copy_table(t->cs_store, t->cs_num, CS_SIZE)) == NULL)
+        mgoto(error);
+
+    reg->cs_num = t->cs_num;
+
+    if ((ns = reg->ns = calloc(1, sizeof(struct nfa_storage))) == NULL)
+        mgoto(error);
+
+    ns->cs_store = reg->cs_store;
+    ns->i = n;
+    ns->n = n;
+
+    if ((ns->type = copy_table(t->type, n, 1)) == NULL
+        || (ns->link0 = copy_table(t->link0, n, sizeof(size_t))) == NULL
+        || (ns->link1 = copy_table(t->link1, n, sizeof(size_t))) == NULL
+        || (ns->cs = copy_table(t->cs, n, sizeof(size_t))) == NULL)
+        mgoto(error);
+
+    memcpy(reg->byte_class, t->byte_class, UCHAR_MAX + 1);
+    reg->num_classes = t->num_classes;
+    reg->nfa_start = t->nfa_start;
+    reg->nfa_end = t->nfa_end;
+
+    if ((reg->cl_off = copy_table(t->cl_off, num + 1, sizeof(size_t))) == NULL
+        || (reg->cl = copy_table(t->cl, t->cl_off[num], sizeof(size_t)))
+            == NULL
+        || (reg->rcl_off = copy_table(t->rcl_off, rnum + 1, sizeof(size_t)))
+            == NULL
+        || (reg->rcl = copy_table(t->rcl, t->rcl_off[rnum], sizeof(size_t)))
+            == NULL
+        || (reg->rev_start = copy_table(t->rev_start, n, 1)) == NULL)
+        mgoto(error);
+
+    memcpy(reg->rev_empty, t->rev_empty, sizeof(reg->rev_empty));
+
+    reg->anchored = t->anchored;
+    reg->no_empty = t->no_empty;
+    memcpy(reg->first_set.in, t->first, UCHAR_MAX + 1);
+    init_byte_set(&reg->first_set);
+
+    if (t->prefix_len) {
+        if ((reg->prefix = copy_table(t->prefix, t->prefix_len, 1)) == NULL)
+            mgoto(error);
+
+        reg->prefix_len = t->prefix_len;
+    }
+
+    if (t->req_len) {
+        if ((reg->req = copy_table(t->req, t->req_len, 1)) == NULL)
+            mgoto(error);
+
+        reg->req_len = t->req_len;
+    }
+
+    reg->bp_num = t->bp_num;
+    memcpy(reg->bp_b, t->bp_b, sizeof(reg->bp_b));
+    memcpy(reg->bp_start, t->bp_start, sizeof(reg->bp_start));
+    memcpy(reg->bp_final, t->bp_final, sizeof(reg->bp_final));
+    memcpy(reg->bp_empty, t->bp_empty, sizeof(reg->bp_empty));
+
+    if (t->bp) {
+        if ((reg->bp_follow = copy_table(
+                 t->bp_follow, t->bp_follow_num, sizeof(unsigned long)))
+            == NULL)
+            mgoto(error);
+
+        reg->bp = 1;
+    }
+
+    if (init_scratch(reg, 0))
+        mgoto(error);
+
+    if (!reg->bp && dfa_mem_limit
+        && (reg->dfa = init_dfa(reg->num_classes)) == NULL)
+        mgoto(error);
+
+    *regex_st = reg;
+    return 0;
+
+usage_error:
+    ret = USAGE_ERROR;
+
+error:
+    regex_free(reg);
+    return ret;
+}
+
+/*
+ * Adds node x to the active set z, with thread start v, unless it is already
+ * active. Threads are added in order of their start, so the first thread to
+ * reach a node is the one that started furthest left, and is kept.
+ */
+#define add_thread(z, tb, x, v)                                               \
+    do {                                                                      \
+        if (!in_set(z, x)) {                                                  \
+            (z)->sparse[x] = (z)->i;                                          \
+            (z)->dense[(z)->i++] = (x);                                       \
+            (tb)[x] = (v);                                                    \
+        }                                                                     \
+    } while (0)
+
+#define check_for_winner                                                      \
+    do {                                                                      \
+        if (in_set(z, reg->nfa_end)) {                                        \
+            /*                                                                \
+             * End node is in state. Record the match. Threads that started   \
+             * further left always win, and of those, the regex takes the     \
+             * longest match, so OK to overwrite any previous match.          \
+             */                                                               \
+            match_start = reg->state[reg->nfa_end];                           \
+            last_match = pos;                                                 \
+            found = 1;                                                        \
+        }                                                                     \
+        /*                                                                    \
+         * Threads that started after the match cannot win. These are all at  \
+         * the back, as the set is ordered by thread start.                   \
+         */                                                                   \
+        if (found)                                                            \
+            while (z->i && reg->state[z->dense[z->i - 1]] > match_start)      \
+                --z->i;                                                       \
+                                                                              \
+        if (!z->i && (found || !unanchored)) {                                \
+            /* All nodes out */                                               \
+            goto report;                                                      \
+        }                                                                     \
+    } while (0)
+
+#define print_active_set(z, tb)                                               \
+    for (i = 0; i < (z)->i; ++i)                                              \
+    fprintf(stderr, "Node %lu: %lu\n", (unsigned long) (z)->dense[i],         \
+        (unsigned long) (tb)[(z)->dense[i]])
+
+static int run_nfa(const char *text, size_t text_size, const char *text2,
+    size_t text2_size, int sol, int eot, struct regex *reg, int unanchored,
+    size_t *match_offset, size_t *match_len, int verbose)
+{
+    /*
+     * When unanchored is zero, the NFA is only run from the start of text.
+     * Otherwise, the start node is added to the state on every step (until
+     * a match is found), so that all start positions are tried in one
+     * left-to-right pass. Each in-state node remembers the leftmost start that
+     * reached it, so the leftmost-longest match is reported.
+     * Only the active nodes are visited, so the cost per character depends
+     * on the number of in-state nodes, not the size of the NFA.
+     * The text continues into text2 (which can be NULL with a size of zero),
+     * so that matches can span the two. The match offset is relative to
+     * the start of text. eot is the end of line status of the end of the
+     * text, which is zero when the text has been cut short.
+     */
+    struct nfa_storage *ns;
+    struct sparse_set *z, *k;
+    const char *p;
+    size_t pos = 0, last_match = 0, match_start = 0;
+    const size_t *c, *c_stop;
+    unsigned char u;
+    size_t s, i, x, starts = 0, steps = 0, peak = 0;
+    int eol, found = 0;
+
+    ns = reg->ns; /* Make a shortcut so that lk works */
+    z = reg->ss;
+    k = reg->kern;
+    p = text;
+    s = text_size;
+
+    if (verbose) {
+        fprintf(stderr, "=== Start of NFA run ===\n");
+        fprintf(stderr, "Start node: %lu\nEnd node: %lu\n", reg->nfa_start,
+            reg->nfa_end);
+    }
+
+    /* Clear active sets */
+    z->i = 0;
+    k->i = 0;
+
+    while (1) {
+        if (!s && text2_size) {
+            /* Continue into the second segment */
+            p = text2;
+            s = text2_size;
+            text2_size = 0;
+        }
+
+        /*
+         * sol is initially inherited from the function call, as it is
+         * internally unknown if text is at the start of the greater context
+         * line. This is because this function can be called repetitively
+         * by an advancing wrapper.
+         */
+
+        /* Set start node. It commenced last, so goes at the back. */
+        if (!pos || (unanchored && !found)) {
+            add_thread(k, reg->state_next, reg->nfa_start, pos);
+            ++starts;
+        }
+
+        /*
+         * Set end of line read status.
+         * Note that the character \n cannot match when in newline sensitive
+         * (not insensitive) mode, as the process will stop before it is read.
+         */
+        eol = !s ? eot : *p == '\n' && !reg->nl_ins;
+
+        /*
+         * Move without reading a character from text, using the precomputed
+         * closures. The kernel is ordered by thread start, so the in-state
+         * nodes will be too.
+         */
+        z->i = 0;
+        for (i = 0; i < k->i; ++i) {
+            x = k->dense[i];
+            c = reg->cl + reg->cl_off[cl_key(x, sol, eol)];
+            c_stop = reg->cl + reg->cl_off[cl_key(x, sol, eol) + 1];
+            while (c != c_stop) {
+                add_thread(z, reg->state, *c, reg->state_next[x]);
+                ++c;
+            }
+        }
+
+        steps += z->i;
+        if (z->i > peak)
+            peak = z->i;
+
+        if (verbose) {
+            fprintf(stderr, "No read:\n");
+            print_active_set(z, reg->state);
+        }
+
+        check_for_winner;
+
+        if (eol || !s) {
+            if (!s || !unanchored || found)
+                goto report;
+
+            /*
+             * Newline sensitive mode. No match can cross the \n, so start
+             * again from the next line.
+             */
+            k->i = 0;
+            ++p;
+            --s;
+            ++pos;
+            sol = 1;
+            continue;
+        }
+
+        /* Read a char */
+        u = *p++;
+        --s;
+        ++pos;
+
+        /* Deactivate start of line read status after first read */
+        sol = 0;
+
+        if (verbose)
+            fprintf(stderr, "Read char: %c\n", u);
+
+        /* Advance or be eliminated */
+        k->i = 0;
+        for (i = 0; i < z->i; ++i) {
+            x = z->dense[i];
+            if (lk_type(x) == CHAR_SET && cs_test(lk_cs(x), u))
+                add_thread(k, reg->state_next, lk_link0(x), reg->state[x]);
+        }
+
+        if (verbose)
+            print_active_set(k, reg->state_next);
+
+        if (!k->i && (found || !unanchored)) {
+            /* All nodes out */
+            goto report;
+        }
+    }
+
+report:
+
+    if (reg->stats != NULL) {
+        reg->stats->bytes_scanned += pos;
+        reg->stats->starts += starts;
+        reg->stats->nfa_steps += steps;
+        if (peak > reg->stats->peak_active)
+            reg->stats->peak_active = peak;
+    }
+
+    /* End of text */
+    if (!found) {
+        if (verbose)
+            fprintf(stderr, " => NO MATCH\n");
+
+        return NO_MATCH;
+    }
+
+    *match_offset = match_start;
+    *match_len = last_match - match_start;
+
+    if (verbose)
+        fprintf(stderr, " => MATCH\n");
+
+    return MATCH;
+}
+
+#undef add_thread
+#undef check_for_winner
+#undef print_active_set
+
+static int cmp_node(const void *a, const void *b)
+{
+    size_t x = *(const size_t *) a, y = *(const size_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static size_t hash_kernel(const size_t *k, size_t k_size, int sol)
+{
+    /* djb2 */
+    size_t h = 5381 + sol;
+
+    while (k_size--) h = h * 33 ^ *k++;
+
+    return h;
+}
+
+static void flush_dfa(struct dfa *d)
+{
+    d->i = 0;
+    d->pool_i = 0;
+    memset(d->ht, '\0', d->ht_n * sizeof(size_t));
+    d->start[0] = DFA_UNKNOWN;
+    d->start[1] = DFA_UNKNOWN;
+    ++d->flushes;
+}
+
+static size_t dfa_mem(struct dfa *d, size_t n, size_t pool_n)
+{
+    /* Bytes used by a cache with n states and a pool of pool_n nodes */
+    return n * (sizeof(struct dfa_state) + (d->row + 2) * sizeof(size_t))
+        + pool_n * sizeof(size_t);
+}
+
+static int grow_dfa(struct dfa *d, size_t will_use_pool)
+{
+    /*
+     * Makes room for one more state and will_use_pool more pool entries.
+     * Returns 1 when this would exceed the memory cap (or on error).
+     */
+    struct dfa_state *t_st;
+    size_t *t, new_n, new_pool_n, j, h;
+
+    if (d->i == d->n) {
+        if (mof(d->n, 2 * (d->row + 2) * sizeof(size_t), SIZE_MAX))
+            return 1;
+
+        new_n = d->n * 2;
+        if (dfa_mem(d, new_n, d->pool_n) > dfa_mem_limit)
+            return 1;
+
+        if ((t_st = realloc(d->st, new_n * sizeof(struct dfa_state))) == NULL)
+            return 1;
+
+        d->st = t_st;
+
+        if ((t = realloc(d->trans, new_n * d->row * sizeof(size_t))) == NULL)
+            return 1;
+
+        d->trans = t;
+        d->n = new_n;
+
+        /* Keep the load factor at or under a half */
+        if ((t = calloc(new_n * 2, sizeof(size_t))) == NULL)
+            return 1;
+
+        free(d->ht);
+        d->ht = t;
+        d->ht_n = new_n * 2;
+
+        for (j = 0; j < d->i; ++j) {
+            h = hash_kernel(d->pool + d->st[j].kernel, d->st[j].kernel_size,
+                    d->st[j].sol)
+                & (d->ht_n - 1);
+            while (d->ht[h]) h = (h + 1) & (d->ht_n - 1);
+
+            d->ht[h] = j + 1;
+        }
+    }
 
-            negate_set = 0;
+    if (will_use_pool > d->pool_n - d->pool_i) {
+        if (aof(d->pool_i, will_use_pool, SIZE_MAX)
+            || mof(d->pool_i + will_use_pool, 2 * sizeof(size_t), SIZE_MAX))
+            return 1;
 
-            if (*p == '^') {
-                negate_set = 1;
-                ++p;
-            }
+        new_pool_n = (d->pool_i + will_use_pool) * 2;
+        if (dfa_mem(d, d->n, new_pool_n) > dfa_mem_limit)
+            return 1;
 
-            first_ch_in_set = 1;
+        if ((t = realloc(d->pool, new_pool_n * sizeof(size_t))) == NULL)
+            return 1;
 
-            while (1) {
-                /* Check for range */
-                if ((first_ch_in_set || (*p != ']' && *p != EOF))
-                    && *(p + 1) == '-' && *(p + 2) != ']' && *(p + 2) != EOF) {
-                    if (*p > *(p + 2))
-                        d_mgoto(syntax_error, "Descending range\n");
+        d->pool = t;
+        d->pool_n = new_pool_n;
+    }
 
-                    for (y = *p; y <= *(p + 2); ++y)
-                        add_to_char_set(ri->char_set, y, case_ins);
+    return 0;
+}
 
-                    p += 2;
-                } else if (*p == ']' && !first_ch_in_set) {
-                    ++p;
-                    break; /* End of set */
-                } else if (*p == EOF) {
-                    d_mgoto(syntax_error, "Unclosed character set\n");
-                } else {
-                    add_to_char_set(ri->char_set, *p, case_ins);
-                }
-                first_ch_in_set = 0;
-                ++p;
-            }
+static size_t dfa_state(struct regex *reg, int sol, size_t *flush_quota)
+{
+    /*
+     * Looks up, or builds, the DFA state with the kernel in reg->kern.
+     * Returns the state index, or DFA_UNKNOWN if the NFA needs to take over.
+     */
+    struct nfa_storage *ns = reg->ns;
+    struct dfa *d = reg->dfa;
+    struct sparse_set *k = reg->kern, *z = reg->ss;
+    struct dfa_state *st;
+    size_t h, j, x, idx, *row;
+
+    qsort(k->dense, k->i, sizeof(size_t), cmp_node);
+
+    h = hash_kernel(k->dense, k->i, sol) & (d->ht_n - 1);
+    while ((idx = d->ht[h])) {
+        st = d->st + idx - 1;
+        if (st->sol == sol && st->kernel_size == k->i
+            && !memcmp(d->pool + st->kernel, k->dense, k->i * sizeof(size_t)))
+            return idx - 1; /* Cache hit */
+
+        h = (h + 1) & (d->ht_n - 1);
+    }
 
-            if (negate_set)
-                for (i = 0; i <= UCHAR_MAX; ++i)
-                    ri->char_set[i] = !ri->char_set[i];
-        } else {
-            /* Operators and other characters */
-            switch (x) {
-                /* Operators */
-            case '(':
-                ri->operator= LEFT_PAREN;
-                break;
-            case ')':
-                ri->operator= RIGHT_PAREN;
-                break;
-            case '+':
-                ri->operator= ONE_OR_MORE;
-                break;
-            case '?':
-                ri->operator= ZERO_OR_ONE;
-                break;
-            case '*':
-                ri->operator= ZERO_OR_MORE;
-                break;
-            case '^':
-                ri->operator= SOL_ANCHOR;
-                break;
-            case '$':
-                ri->operator= EOL_ANCHOR;
-                break;
-            case '|':
-                ri->operator= OR;
-                break;
-            default:
-                /* Other characters */
-                if ((ri->char_set = calloc(UCHAR_MAX + 1, 1)) == NULL)
-                    mgoto(error);
+    /* Build the state. The start node is in every kernel. */
+    z->i = 0;
+    for (j = 0; j < k->i; ++j) add_closure(reg, z, k->dense[j], sol, 0);
 
-                ri->operator= NO_OPERATOR;
+    add_closure(reg, z, reg->nfa_start, sol, 0);
 
-                if (x == '.') {
-                    /* Set of all chars */
-                    for (i = 0; i <= UCHAR_MAX; ++i) ri->char_set[i] = 1;
+    if (grow_dfa(d, k->i + z->i)) {
+        if (!*flush_quota)
+            return DFA_UNKNOWN;
 
-                    if (!nl_ins)
-                        ri->char_set['\n'] = 0;
-                } else {
-                    add_to_char_set(ri->char_set, x, case_ins);
-                }
+        --*flush_quota;
+        flush_dfa(d);
 
-                break;
-            }
-        }
-        if ((ri->operator== NO_OPERATOR || ri->operator== LEFT_PAREN || ri->
-                operator== SOL_ANCHOR)
-            && prev != NULL
-            && (prev->
-                operator== NO_OPERATOR || prev->
-                operator== ONE_OR_MORE || prev->
-                operator== ZERO_OR_ONE || prev->
-                operator== ZERO_OR_MORE || prev->
-                operator== RIGHT_PAREN || prev->operator== EOL_ANCHOR)) {
-            /* Link in concatenation */
-            if ((t = init_regex_item()) == NULL)
-                mgoto(error);
+        /* Must fit into an empty cache */
+        if (grow_dfa(d, k->i + z->i))
+            return DFA_UNKNOWN;
+    }
 
-            t->operator= CONCAT;
+    idx = d->i;
+    st = d->st + idx;
 
-            prev->next = t;
-            t->next = ri;
-        }
+    st->sol = sol;
+    st->kernel = d->pool_i;
+    st->kernel_size = k->i;
+    memcpy(d->pool + d->pool_i, k->dense, k->i * sizeof(size_t));
+    d->pool_i += k->i;
 
-        prev = ri;
+    st->char_nodes = d->pool_i;
+    for (j = 0; j < z->i; ++j) {
+        x = z->dense[j];
+        if (lk_type(x) == CHAR_SET)
+            d->pool[d->pool_i++] = x;
     }
+    st->char_nodes_size = d->pool_i - st->char_nodes;
 
-    *ri_head = head;
+    st->match = in_set(z, reg->nfa_end);
 
-    return 0;
+    /* Closure is additive, so the end of line status can be added on */
+    for (j = 0; j < k->i; ++j) add_closure(reg, z, k->dense[j], sol, 1);
 
-error:
-    ret = 1;
+    add_closure(reg, z, reg->nfa_start, sol, 1);
+    st->eol_match = in_set(z, reg->nfa_end);
 
-syntax_error:
-    if (!ret)
-        ret = SYNTAX_ERROR;
+    row = d->trans + idx * d->row;
+    for (j = 0; j < d->row; ++j) row[j] = DFA_UNKNOWN;
 
-    free_regex_chain(head);
-    return ret;
-}
+    if (!reg->nl_ins)
+        row[reg->byte_class['\n']] = DFA_NEWLINE;
 
-#define pop_operator_to_output                                                \
-    do {                                                                      \
-        if (output_tail == NULL) {                                            \
-            output_tail = operator_stack;                                     \
-            postfix = output_tail;                                            \
-        } else {                                                              \
-            output_tail->next = operator_stack;                               \
-            output_tail = output_tail->next;                                  \
-        }                                                                     \
-        operator_stack = operator_stack->next;                                \
-    } while (0)
+    /* Link into the hash table */
+    h = hash_kernel(k->dense, k->i, sol) & (d->ht_n - 1);
+    while (d->ht[h]) h = (h + 1) & (d->ht_n - 1);
 
-static void shunting_yard(struct regex_item **ri_head)
-{
-    struct regex_item *operator_stack = NULL;
-    struct regex_item *postfix = NULL; /* Output head */
-    struct regex_item *output_tail = NULL;
-    struct regex_item *next = NULL;
-    struct regex_item *ri, *t;
+    d->ht[h] = idx + 1;
 
-    ri = *ri_head;
-    while (ri != NULL) {
-        next = ri->next; /* Backup */
-        if (ri->operator== NO_OPERATOR) {
-            if (output_tail == NULL) {
-                output_tail = ri;
-                postfix = output_tail;
-            } else {
-                output_tail->next = ri;
-                output_tail = ri;
-            }
-        } else if (ri->operator== LEFT_PAREN) {
-            ri->next = operator_stack;
-            operator_stack = ri;
-        } else if (ri->operator== RIGHT_PAREN) {
-            while (operator_stack != NULL) {
-                if (operator_stack->operator== LEFT_PAREN) {
-                    t = operator_stack;
-                    operator_stack = operator_stack->next;
-                    /* Need to free left parenthesis, as removed */
-                    t->next = NULL; /* Isolate */
-                    free_regex_chain(t);
-                    break;
-                } else {
-                    pop_operator_to_output;
-                }
-            }
-            /* Need to free right parenthesis, as removed */
-            /* Isolate. next has already been backed up above. */
-            ri->next = NULL;
-            free_regex_chain(ri);
-        } else {
-            while (operator_stack != NULL) {
-                if (operator_stack->operator == LEFT_PAREN
-                    || (op_detail[ri->operator].associativity == 'L'
-                        && op_detail[operator_stack->operator].precedence
-                        < op_detail[ri->operator].precedence)
-                    || (op_detail[ri->operator].associativity == 'R'
-                        && op_detail[operator_stack->operator].precedence
-                        <= op_detail[ri->operator].precedence)) {
-                    break;
-                } else {
-                    pop_operator_to_output;
-                }
-            }
-            ri->next = operator_stack;
-            operator_stack = ri;
-        }
-        ri = next; /* Restore from backup */
-    }
-    while (operator_stack != NULL) pop_operator_to_output;
+    if (!k->i)
+        d->start[sol] = idx;
 
-    if (output_tail != NULL)
-        output_tail->next = NULL;
+    ++d->i;
 
-    *ri_head = postfix;
+    return idx;
 }
 
-#undef pop_operator_to_output
+static size_t dfa_next(
+    struct regex *reg, size_t cur, unsigned char u, size_t *flush_quota)
+{
+    /* Builds the transition from state cur upon reading u */
+    struct nfa_storage *ns = reg->ns;
+    struct dfa *d = reg->dfa;
+    struct sparse_set *k = reg->kern;
+    const size_t *cn;
+    size_t j, next, flushes;
+
+    k->i = 0;
+    cn = d->pool + d->st[cur].char_nodes;
+    for (j = 0; j < d->st[cur].char_nodes_size; ++j)
+        if (cs_test(lk_cs(cn[j]), u))
+            add_to_set(k, lk_link0(cn[j]));
+
+    flushes = d->flushes;
+    if ((next = dfa_state(reg, 0, flush_quota)) == DFA_UNKNOWN)
+        return DFA_UNKNOWN;
+
+    /* State cur no longer exists if the cache was flushed */
+    if (d->flushes == flushes)
+        *(d->trans + cur * d->row + reg->byte_class[u]) = next;
+
+    return next;
+}
 
-static int thompsons_construction(const struct regex_item *ri_head,
-    struct nfa_storage **nfa_store, size_t *nfa_start, size_t *nfa_end)
+static size_t dfa_start(struct regex *reg, int sol, size_t *flush_quota)
 {
-    int ret = 0;
-    struct nfa_storage *ns = NULL;
-    struct operand_stack *z = NULL;
-    const struct regex_item *ri;
-    size_t start_a, end_a, start_b, end_b, start_c, end_c;
+    if (reg->dfa->start[sol] != DFA_UNKNOWN)
+        return reg->dfa->start[sol];
 
-    if ((ns = init_nfa_storage()) == NULL)
-        mgoto(error);
+    reg->kern->i = 0;
+    return dfa_state(reg, sol, flush_quota);
+}
 
-    if ((z = init_operand_stack()) == NULL)
-        mgoto(error);
+static int dfa_search(const char *text, size_t text_size, int sol,
+    struct regex *reg, const char **from, int *from_sol)
+{
+    /*
+     * Scans the text with the DFA until a match ends. The DFA does not know
+     * where the match started, but the leftmost match cannot start before
+     * the last point where all threads had been eliminated. That point is
+     * returned in from, so that the NFA can take over from there.
+     * Returns MATCH, NO_MATCH, or ERROR_BUT_CONTIN if the DFA gave up.
+     */
+    struct dfa *d = reg->dfa;
+    const unsigned char *p, *p_stop, *q;
+    size_t cur, next, flush_quota = DFA_MAX_FLUSHES;
+    size_t skips = 0, skipped = 0, newlines = 0, misses = 0, built = 0;
+    size_t flushes = d->flushes, scanned;
+    int r = ERROR_BUT_CONTIN;
 
-    ri = ri_head;
-    while (ri != NULL) {
-        switch (ri->operator) {
-        case NO_OPERATOR:
-            if (issue_node(ns, &start_c))
-                mgoto(error);
+    p = (const unsigned char *) text;
+    p_stop = p + text_size;
 
-            if (issue_node(ns, &end_c))
-                mgoto(error);
+    *from = text;
+    *from_sol = sol;
 
-            lk(start_c).link0 = end_c;
-            lk(start_c).link_type = CHAR_SET;
-            /* Responsibility to free remains with free_regex_chain */
-            lk(start_c).char_set = ri->char_set;
+    if ((cur = dfa_start(reg, sol, &flush_quota)) == DFA_UNKNOWN)
+        goto done;
 
-            if (push_operand_stack(z, start_c, end_c))
-                mgoto(error);
+    if (d->st[cur].match) {
+        r = MATCH;
+        goto done;
+    }
 
-            break;
-        case LEFT_PAREN:
-        case RIGHT_PAREN:
-            d_mgoto(syntax_error, "Parenthesis in postfix form\n");
-            break;
-        case ONE_OR_MORE:
-            if (pop_operand_stack(z, &start_b, &end_b))
-                mgoto(error);
+    while (p != p_stop) {
+        if (cur == d->start[0]
+            && (q = (const unsigned char *) prefilter(
+                    reg, (const char *) p, (const char *) p_stop))
+                != p) {
+            /* Skip ahead */
+            ++skips;
+            skipped += q - p;
+            p = q;
+            *from = (const char *) p;
+            *from_sol = !reg->nl_ins && *(p - 1) == '\n';
+
+            if ((cur = dfa_start(reg, *from_sol, &flush_quota))
+                == DFA_UNKNOWN)
+                goto done;
+
+            if (d->st[cur].match) {
+                r = MATCH;
+                goto done;
+            }
 
-            /* Loop-back */
-            lk(end_b).link0 = start_b;
+            continue;
+        }
 
-            /* New end node */
-            if (issue_node(ns, &end_c))
-                mgoto(error);
+        next = *(d->trans + cur * d->row + reg->byte_class[*p]);
 
-            lk(end_b).link1 = end_c;
-            lk(end_b).link_type = BOTH_EPSILON;
+        if (next == DFA_NEWLINE) {
+            if (d->st[cur].eol_match) {
+                r = MATCH;
+                goto done;
+            }
 
-            if (push_operand_stack(z, start_b, end_c))
-                mgoto(error);
+            /* Start again on the next line */
+            ++p;
+            ++newlines;
+            *from = (const char *) p;
+            *from_sol = 1;
 
-            break;
-        case ZERO_OR_ONE:
-            if (pop_operand_stack(z, &start_b, &end_b))
-                mgoto(error);
+            if ((cur = dfa_start(reg, 1, &flush_quota)) == DFA_UNKNOWN)
+                goto done;
 
-            /* New start node */
-            if (issue_node(ns, &start_c))
-                mgoto(error);
+            if (d->st[cur].match) {
+                r = MATCH;
+                goto done;
+            }
 
-            /* New end node */
-            if (issue_node(ns, &end_c))
-                mgoto(error);
+            continue;
+        }
 
-            /* Link in new nodes */
-            lk(start_c).link0 = start_b;
-            lk(end_b).link0 = end_c;
-            lk(end_b).link_type = EPSILON;
+        if (next == DFA_UNKNOWN) {
+            ++misses;
+            if ((next = dfa_next(reg, cur, *p, &flush_quota)) == DFA_UNKNOWN)
+                goto done;
 
-            /* Bypass */
-            lk(start_c).link1 = end_c;
+            ++built;
+        }
 
-            lk(start_c).link_type = BOTH_EPSILON;
+        cur = next;
+        ++p;
 
-            if (push_operand_stack(z, start_c, end_c))
-                mgoto(error);
+        if (d->st[cur].match) {
+            r = MATCH;
+            goto done;
+        }
 
-            break;
-        case ZERO_OR_MORE:
-            if (pop_operand_stack(z, &start_b, &end_b))
-                mgoto(error);
+        if (cur == d->start[0]) {
+            /* All threads out */
+            *from = (const char *) p;
+            *from_sol = 0;
+        }
+    }
 
-            /* New start node */
-            if (issue_node(ns, &start_c))
-                mgoto(error);
+    r = d->st[cur].eol_match ? MATCH : NO_MATCH;
+
+done:
+    if (reg->stats != NULL) {
+        /* Every byte read, other than a \n, took a transition */
+        scanned = p - (const unsigned char *) text - skipped;
+        reg->stats->bytes_scanned += scanned;
+        reg->stats->prefilter_skips += skips;
+        reg->stats->bytes_skipped += skipped;
+        reg->stats->dfa_hits += scanned - newlines - built;
+        reg->stats->dfa_misses += misses;
+        reg->stats->dfa_flushes += d->flushes - flushes;
+    }
 
-            /* New end node */
-            if (issue_node(ns, &end_c))
-                mgoto(error);
+    return r;
+}
+
+static int bp_search(const char *text, size_t text_size, int sol,
+    struct regex *reg, const char **from, int *from_sol)
+{
+    /*
+     * Scans the text with the bit-parallel engine until a match ends.
+     * Same as dfa_search, except that it never gives up.
+     */
+    const unsigned char *p, *p_stop, *q;
+    const unsigned long *t;
+    unsigned long d, m;
+    int eol, reset, r = MATCH;
+    size_t skips = 0, skipped = 0;
+
+    p = (const unsigned char *) text;
+    p_stop = p + text_size;
+
+    *from = text;
+    *from_sol = sol;
+
+    d = reg->bp_start[sol];
+    reset = !sol;
+    eol = p == p_stop || (*p == '\n' && !reg->nl_ins);
+    if (reg->bp_empty[sol][eol])
+        goto done;
+
+    while (p != p_stop) {
+        if (*p == '\n' && !reg->nl_ins) {
+            /* Start again on the next line */
+            ++p;
+            *from = (const char *) p;
+            *from_sol = 1;
+            d = reg->bp_start[1];
+            reset = 0;
+            if (reg->bp_empty[1][p == p_stop || *p == '\n'])
+                goto done;
+
+            continue;
+        }
 
-            /* Loop-back */
-            lk(end_b).link0 = start_b;
+        if (reset
+            && (q = (const unsigned char *) prefilter(
+                    reg, (const char *) p, (const char *) p_stop))
+                != p) {
+            /* Skip ahead */
+            ++skips;
+            skipped += q - p;
+            p = q;
+            *from = (const char *) p;
+            *from_sol = !reg->nl_ins && *(p - 1) == '\n';
+            d = reg->bp_start[*from_sol];
+            reset = !*from_sol;
+            eol = p == p_stop || (*p == '\n' && !reg->nl_ins);
+            if (reg->bp_empty[*from_sol][eol])
+                goto done;
+
+            continue;
+        }
 
-            /* Link in new nodes */
-            lk(start_c).link0 = start_b;
-            lk(end_b).link0 = end_c;
+        /* Positions that can read the character */
+        m = d & reg->bp_b[*p];
+        ++p;
 
-            /* Bypass */
-            lk(start_c).link1 = end_c;
+        eol = p == p_stop || (*p == '\n' && !reg->nl_ins);
+        if (m & reg->bp_final[eol] || reg->bp_empty[0][eol])
+            goto done;
 
-            lk(start_c).link_type = BOTH_EPSILON;
-            lk(end_b).link_type = BOTH_EPSILON;
+        if ((reset = !m)) {
+            /* All threads out */
+            *from = (const char *) p;
+            *from_sol = 0;
+        }
 
-            if (push_operand_stack(z, start_c, end_c))
-                mgoto(error);
+        /* Union of the follow sets, plus a new thread */
+        d = reg->bp_start[0];
+        for (t = reg->bp_follow; m; m >>= 8, t += UCHAR_MAX + 1)
+            d |= t[m & 0xFF];
+    }
 
-            break;
-        case CONCAT:
-            if (pop_operand_stack(z, &start_b, &end_b))
-                mgoto(error);
+    r = NO_MATCH;
 
-            if (pop_operand_stack(z, &start_a, &end_a))
-                mgoto(error);
+done:
+    if (reg->stats != NULL) {
+        reg->stats->bytes_scanned
+            += p - (const unsigned char *) text - skipped;
+        reg->stats->prefilter_skips += skips;
+        reg->stats->bytes_skipped += skipped;
+    }
 
-            /* Copy contents */
-            copy_node(end_a, start_b);
+    return r;
+}
 
-            /*
-             * Remove unneeded node.
-             * Only concatenation removes a node.
-             * OK, as start nodes are not referenced by other nodes.
-             */
-            if (delete_node(ns, start_b))
-                mgoto(error);
+/* Records that the prefilter jumped over n bytes */
+#define record_skip(reg, n)                                                   \
+    do {                                                                      \
+        if ((reg)->stats != NULL) {                                           \
+            ++(reg)->stats->prefilter_skips;                                  \
+            (reg)->stats->bytes_skipped += (n);                               \
+        }                                                                     \
+    } while (0)
 
-            if (push_operand_stack(z, start_a, end_b))
-                mgoto(error);
+static char *internal_regex_search(const char *text, size_t text_size, int sol,
+    struct regex *reg, size_t *match_len, int verbose)
+{
+    /* Advances */
+    char *match = NULL;
+    size_t mo, ml; /* Match offset and length */
+    const char *from, *q;
+    int r, from_sol;
 
-            break;
-        case SOL_ANCHOR:
-            if (z->i) {
-                if (pop_operand_stack(z, &start_b, &end_b))
-                    mgoto(error);
+    if (reg->stats != NULL)
+        ++reg->stats->searches;
 
-                /* New start node */
-                if (issue_node(ns, &start_c))
-                    mgoto(error);
+    if (reg->req_len) {
+        /* No match is possible without the required literal */
+        if (reg->req_len == 1)
+            q = memchr(text, *reg->req, text_size);
+        else
+            q = quick_search(text, text_size, reg->req, reg->req_len);
 
-                /* Link in */
-                lk(start_c).link0 = start_b;
-                lk(start_c).link_type = SOL_READ_STATUS;
+        if (q == NULL) {
+            if (verbose)
+                fprintf(stderr, "Required literal not found\n");
 
-                if (push_operand_stack(z, start_c, end_b))
-                    mgoto(error);
-            } else {
-                /* ^ is a valid regex by itself */
-                if (issue_node(ns, &start_c))
-                    mgoto(error);
+            record_skip(reg, text_size);
 
-                if (issue_node(ns, &end_c))
-                    mgoto(error);
+            return NULL;
+        }
 
-                lk(start_c).link0 = end_c;
-                lk(start_c).link_type = SOL_READ_STATUS;
+        if (!reg->nl_ins) {
+            /* Matches cannot cross lines, so go to the line of the literal */
+            while (q != text && *(q - 1) != '\n') --q;
 
-                if (push_operand_stack(z, start_c, end_c))
-                    mgoto(error);
+            if (q != text) {
+                record_skip(reg, q - text);
+                text_size -= q - text;
+                text = q;
+                sol = 1;
             }
+        }
+    }
 
-            break;
-        case EOL_ANCHOR:
-            if (z->i) {
-                if (pop_operand_stack(z, &start_b, &end_b))
-                    mgoto(error);
+    if (!reg->bp && reg->dfa == NULL && !sol) {
+        q = prefilter(reg, text, text + text_size);
+        if (q != text) {
+            record_skip(reg, q - text);
+            text_size -= q - text;
+            text = q;
+            sol = !reg->nl_ins && *(q - 1) == '\n';
+        }
+    }
 
-                /* New end node */
-                if (issue_node(ns, &end_c))
-                    mgoto(error);
+    if (reg->bp || reg->dfa != NULL) {
+        if (reg->bp) {
+            r = bp_search(text, text_size, sol, reg, &from, &from_sol);
 
-                lk(end_b).link0 = end_c;
-                lk(end_b).link_type = EOL_READ_STATUS;
+            if (verbose)
+                fprintf(stderr, "Bit-parallel: %s, %lu positions\n",
+                    r == MATCH ? "Match" : "No match",
+                    (unsigned long) reg->bp_num);
+        } else {
+            r = dfa_search(text, text_size, sol, reg, &from, &from_sol);
+
+            if (verbose)
+                fprintf(stderr, "DFA: %s, %lu states, %lu flushes\n",
+                    r == MATCH         ? "Match"
+                        : r == NO_MATCH ? "No match"
+                                        : "Gave up",
+                    (unsigned long) reg->dfa->i,
+                    (unsigned long) reg->dfa->flushes);
+        }
 
-                if (push_operand_stack(z, start_b, end_c))
-                    mgoto(error);
-            } else {
-                /* $ is a valid regex by itself */
-                if (issue_node(ns, &start_c))
-                    mgoto(error);
+        if (r == NO_MATCH) {
+            if (verbose)
+                fprintf(stderr, "=== Search result ===\nNo match\n");
 
-                if (issue_node(ns, &end_c))
-                    mgoto(error);
+            return NULL;
+        }
 
-                lk(start_c).link0 = end_c;
-                lk(start_c).link_type = EOL_READ_STATUS;
+        /* The NFA finds where the leftmost-longest match starts and ends */
+        text_size -= from - text;
+        text = from;
+        sol = from_sol;
+    }
 
-                if (push_operand_stack(z, start_c, end_c))
-                    mgoto(error);
-            }
+    r = run_nfa(text, text_size, NULL, 0, sol, 1, reg, 1, &mo, &ml, verbose);
 
-            break;
-        case OR:
-            if (pop_operand_stack(z, &start_b, &end_b))
-                mgoto(error);
+    if (verbose)
+        fprintf(stderr, "=== Search result ===\n");
 
-            if (pop_operand_stack(z, &start_a, &end_a))
-                mgoto(error);
+    if (r == NO_MATCH) {
+        if (verbose)
+            fprintf(stderr, "No match\n");
 
-            /* New start node */
-            if (issue_node(ns, &start_c))
-                mgoto(error);
+        return NULL;
+    }
 
-            /* New end node */
-            if (issue_node(ns, &end_c))
-                mgoto(error);
+    match = (char *) text + mo;
 
-            /* Branch start */
-            lk(start_c).link0 = start_a;
-            lk(start_c).link1 = start_b;
-            lk(start_c).link_type = BOTH_EPSILON;
+    if (verbose) {
+        fprintf(stderr, "match_offset: %lu\n", match - text);
+        fprintf(stderr, "match_len: %lu\n", ml);
+    }
 
-            /* Connect end */
-            lk(end_a).link0 = end_c;
-            lk(end_a).link_type = EPSILON;
+    *match_len = ml;
+    return match;
+}
 
-            lk(end_b).link0 = end_c;
-            lk(end_b).link_type = EPSILON;
+#undef record_skip
 
-            if (push_operand_stack(z, start_c, end_c))
-                mgoto(error);
+void set_regex_dfa_mem_limit(size_t limit)
+{
+    /*
+     * Caps the memory used by the DFA cache of each regex compiled from now
+     * on. When the cap is reached the cache is flushed, and if that happens
+     * too often, the search falls back to running the NFA alone.
+     * Zero switches the DFA off.
+     */
+    dfa_mem_limit = limit;
+}
 
-            break;
-        }
+void set_regex_stats(struct regex_stats *st)
+{
+    /*
+     * Regexes compiled from now on, and those in the cache behind
+     * regex_search and regex_replace, add their search statistics to st.
+     * NULL switches recording off. The caller zeroes st.
+     */
+    stats_sink = st;
+}
 
-        ri = ri->next;
+int regex_stats_to_str(
+    const struct regex_stats *st, char *buf, size_t buf_size)
+{
+    /* One line summary. REGEX_STATS_BUF_SIZE is always large enough. */
+    int r;
+
+    r = snprintf(buf, buf_size,
+        "re: %lu srch, %lu scan, %lu skip in %lu, %lu start, %lu step, "
+        "%lu peak, dfa %lu hit %lu miss %lu flush",
+        (unsigned long) st->searches, (unsigned long) st->bytes_scanned,
+        (unsigned long) st->bytes_skipped,
+        (unsigned long) st->prefilter_skips, (unsigned long) st->starts,
+        (unsigned long) st->nfa_steps, (unsigned long) st->peak_active,
+        (unsigned long) st->dfa_hits, (unsigned long) st->dfa_misses,
+        (unsigned long) st->dfa_flushes);
+
+    if (r < 0 || (size_t) r >= buf_size)
+        return 1;
+
+    return 0;
+}
+
+size_t regex_mem_size(struct regex *reg)
+{
+    /*
+     * Approximate bytes held by a compiled regex, including the DFA cache
+     * as it currently stands.
+     */
+    size_t n = reg->ns->n, num = reg->ns->i * 2 + 2, chunks, s;
+
+    s = sizeof(struct regex) + sizeof(struct nfa_storage) + reg->find_esc_size
+        + (reg->cs_num + 1) * CS_SIZE + reg->prefix_len + reg->req_len;
+    s += n * (1 + 3 * sizeof(size_t)); /* NFA nodes */
+    s += reg->ns->i * 10 * sizeof(size_t) + reg->ns->i; /* Scratch */
+    /* Closures, forwards and reversed */
+    s += (num + 1 + reg->cl_off[num]) * sizeof(size_t);
+    num = reg->ns->i + 2;
+    s += (num + 1 + reg->rcl_off[num]) * sizeof(size_t);
+
+    if (reg->bp_follow != NULL) {
+        chunks = (reg->bp_num + 7) / 8;
+        s += (chunks ? chunks : 1) * (UCHAR_MAX + 1) * sizeof(unsigned long);
     }
 
-    if (pop_operand_stack(z, &start_b, &end_b))
-        d_mgoto(error, "No NFA generated\n");
+    if (reg->dfa != NULL)
+        s += sizeof(struct dfa)
+            + dfa_mem(reg->dfa, reg->dfa->n, reg->dfa->pool_n);
 
-    if (z->i)
-        d_mgoto(syntax_error, "%lu operands left on the stack\n",
-            (unsigned long) z->i);
+    return s;
+}
 
-    /* Fill the last hole (if any) */
-    fill_hole(ns, &start_b, &end_b);
+int regex_exec(struct regex *reg, const char *text, size_t text_size,
+    int sol, size_t *match_offset, size_t *match_len, int verbose)
+{
+    char *m;
+    size_t ml;
 
-    *nfa_start = start_b;
-    *nfa_end = end_b;
-    *nfa_store = ns;
-    free_operand_stack(z);
+    if (reg == NULL || text == NULL)
+        return USAGE_ERROR;
 
-    return 0;
+    m = internal_regex_search(text, text_size, sol, reg, &ml, verbose);
 
-error:
-    ret = 1;
+    if (m == NULL)
+        return NO_MATCH;
 
-syntax_error:
-    if (!ret)
-        ret = SYNTAX_ERROR;
+    *match_offset = m - text;
+    *match_len = ml;
 
-    free_nfa_storage(ns);
-    free_operand_stack(z);
-    return ret;
+    return 0;
 }
 
-static void print_nfa(struct nfa_storage *ns)
+static int split_search(struct regex *reg, const char *text0, size_t size0,
+    const char *text1, size_t size1, int sol, size_t *match_offset,
+    size_t *match_len, int verbose)
 {
-    size_t i;
-    for (i = 0; i < ns->i; ++i) {
-        if (lk(i).link_type != END_NODE) {
-            fprintf(stderr, "%lu -- ", (unsigned long) i);
-            switch (lk(i).link_type) {
-            case BOTH_EPSILON:
-            case EPSILON:
-                putc('e', stderr);
-                break;
-            case SOL_READ_STATUS:
-                putc('^', stderr);
-                break;
-            case EOL_READ_STATUS:
-                putc('$', stderr);
-                break;
-            case CHAR_SET:
-                print_char_set(lk(i).char_set);
-                break;
-            }
-            fprintf(stderr, " --> %lu\n", (unsigned long) lk(i).link0);
+    /*
+     * Searches the text formed by text0 followed by text1. Only a match that
+     * spans the two needs the NFA to be run across them. In newline sensitive
+     * mode that can only happen on the line that contains the join, so
+     * the lines either side of it are searched in place as normal.
+     */
+    const char *m, *q;
+    size_t start, stop, mo;
+
+    if (!size0 || !size1) {
+        /* Only one segment */
+        if (!size0) {
+            text0 = text1;
+            size0 = size1;
+        }
 
-            if (lk(i).link_type == BOTH_EPSILON)
-                fprintf(stderr, "%lu -- e --> %lu\n", (unsigned long) i,
-                    (unsigned long) lk(i).link1);
+        if ((m = internal_regex_search(
+                 text0, size0, sol, reg, match_len, verbose))
+            == NULL)
+            return NO_MATCH;
+
+        *match_offset = m - text0;
+        return 0;
+    }
+
+    if (reg->nl_ins) {
+        /* Matches can span any number of lines */
+        if (run_nfa(text0, size0, text1, size1, sol, 1, reg, 1, match_offset,
+                match_len, verbose)
+            == NO_MATCH)
+            return NO_MATCH;
+
+        return 0;
+    }
+
+    /* The line that contains the join */
+    start = size0;
+    while (start && text0[start - 1] != '\n') --start;
+
+    if ((q = memchr(text1, '\n', size1)) != NULL)
+        stop = q - text1;
+    else
+        stop = size1;
+
+    if (start) {
+        /* Lines before. The \n is left off, as an end of line is implied. */
+        if ((m = internal_regex_search(
+                 text0, start - 1, sol, reg, match_len, verbose))
+            != NULL) {
+            *match_offset = m - text0;
+            return 0;
         }
+
+        sol = 1;
     }
+
+    if (run_nfa(text0 + start, size0 - start, text1, stop, sol, 1, reg, 1,
+            &mo, match_len, verbose)
+        == MATCH) {
+        *match_offset = start + mo;
+        return 0;
+    }
+
+    if (stop == size1)
+        return NO_MATCH;
+
+    /* Lines after */
+    if ((m = internal_regex_search(text1 + stop + 1, size1 - stop - 1, 1, reg,
+             match_len, verbose))
+        == NULL)
+        return NO_MATCH;
+
+    *match_offset = size0 + (m - text1);
+    return 0;
 }
 
-static int compile_regex(const char *regex_str, int nl_ins, int case_ins,
-    struct regex **regex_st, int verbose)
+int regex_iter_init(struct regex_iter *it, struct regex *reg,
+    const char *text0, size_t size0, const char *text1, size_t size1, int sol,
+    size_t from)
 {
-    int ret = 1;
-    struct regex *reg = NULL;
+    /*
+     * Sets up an iterator over the non-overlapping matches in the text formed
+     * by text0 followed by text1 (such as the two sides of a gap buffer),
+     * commencing at offset from. text1 can be NULL when size1 is zero.
+     * sol is the start of line status of the start of text0. Matches are
+     * found in one forward pass, the same ones that regex_exec_replace
+     * replaces: after a match, an empty match where it ended is skipped.
+     */
+    if (it == NULL || reg == NULL || text0 == NULL || (text1 == NULL && size1)
+        || from > size0 + size1)
+        return USAGE_ERROR;
+
+    it->reg = reg;
+    it->text0 = text0;
+    it->size0 = size0;
+    it->text1 = size1 ? text1 : text0;
+    it->size1 = size1;
+    it->pos = from;
+    if (from > size0)
+        it->sol = !reg->nl_ins && text1[from - size0 - 1] == '\n';
+    else if (from)
+        it->sol = !reg->nl_ins && text0[from - 1] == '\n';
+    else
+        it->sol = sol;
 
-    if (regex_str == NULL || *regex_str == '\0')
-        d_mgoto(usage_error, "NULL or empty regex string\n");
+    it->last_set = 0;
+    it->last_end = 0;
+    it->done = 0;
 
-    if ((reg = init_regex()) == NULL)
-        mgoto(error);
+    return 0;
+}
 
-    reg->nl_ins = nl_ins;
+int regex_iter_next(struct regex_iter *it, size_t *match_offset,
+    size_t *match_len, int verbose)
+{
+    /*
+     * Finds the next match. The offset is relative to the start of text0.
+     * Returns NO_MATCH when there are no more.
+     */
+    struct regex *reg = it->reg;
+    size_t size = it->size0 + it->size1, p = it->pos, mo, ml;
+    int r, skip;
+
+    while (!it->done) {
+        if (p && !reg->nl_ins
+            && (p <= it->size0 ? it->text0[p - 1]
+                               : it->text1[p - it->size0 - 1])
+                == '\n') {
+            /* Start of a line. Nothing before it can join with a match. */
+            it->sol = 1;
+            it->last_set = 0;
+        }
 
-    if ((ret = interpret_escaped_chars(
-             regex_str, &reg->find_esc, &reg->find_esc_size)))
-        mgoto(error);
+        if (p <= it->size0)
+            r = split_search(reg, it->text0 + p, it->size0 - p, it->text1,
+                it->size1, it->sol, &mo, &ml, verbose);
+        else
+            r = split_search(reg, it->text1 + (p - it->size0), size - p,
+                it->text1, 0, it->sol, &mo, &ml, verbose);
 
-    if ((ret = char_to_int_eof_term(
-             reg->find_esc, reg->find_esc_size, &reg->find_eof)))
-        mgoto(error);
+        if (r) {
+            it->done = 1;
+            break;
+        }
 
-    if ((ret = create_regex_chain(
-             reg->find_eof, &reg->ri, reg->nl_ins, case_ins)))
-        mgoto(error);
+        mo += p;
+        skip = !ml && it->last_set && mo == it->last_end;
 
-    if (verbose) {
-        fprintf(stderr, "Infix:\n");
-        print_regex_chain(reg->ri);
-    }
+        /* Advance. After an empty match, jump forward a char. */
+        if (p == size || (!ml && mo == size))
+            it->done = 1;
+        else
+            p = ml ? mo + ml : mo + 1;
 
-    shunting_yard(&reg->ri);
+        it->pos = p;
+        it->sol = 0;
+        it->last_set = 1;
+        it->last_end = mo + ml;
 
-    if (verbose) {
-        fprintf(stderr, "Postfix:\n");
-        print_regex_chain(reg->ri);
+        if (!skip) {
+            *match_offset = mo;
+            *match_len = ml;
+            return 0;
+        }
     }
 
-    if ((ret = thompsons_construction(
-             reg->ri, &reg->ns, &reg->nfa_start, &reg->nfa_end)))
-        mgoto(error);
+    return NO_MATCH;
+}
 
-    if (verbose) {
-        fprintf(stderr, "NFA:\n");
-        print_nfa(reg->ns);
-    }
+int regex_exec_split(struct regex *reg, const char *text0, size_t size0,
+    const char *text1, size_t size1, int sol, size_t from, int wrap,
+    size_t *match_offset, size_t *match_len, int verbose)
+{
+    /*
+     * Searches the text formed by text0 followed by text1, such as the two
+     * sides of a gap buffer, without joining them. The search commences at
+     * offset from, and if wrap is set, wraps around to the start of the text.
+     * sol is the start of line status of the start of text0. The offset of
+     * the match is relative to the start of text0.
+     */
+    struct regex_iter it;
+    int ret;
 
-    /* Allocate state tables */
-    if ((reg->state = calloc(reg->ns->i, 1)) == NULL)
-        mgoto(error);
+    if (text1 == NULL)
+        return USAGE_ERROR;
 
-    if ((reg->state_next = calloc(reg->ns->i, 1)) == NULL)
-        mgoto(error);
+    if ((ret = regex_iter_init(
+             &it, reg, text0, size0, text1, size1, sol, from)))
+        return ret;
 
-    *regex_st = reg;
-    return 0;
+    if (!regex_iter_next(&it, match_offset, match_len, verbose))
+        return 0;
 
-usage_error:
-    ret = USAGE_ERROR;
+    if (!wrap || !from)
+        return NO_MATCH;
 
-error:
-    if (reg != NULL)
-        free_regex(reg);
+    regex_iter_init(&it, reg, text0, size0, text1, size1, sol, 0);
 
-    return ret;
+    return regex_iter_next(&it, match_offset, match_len, verbose);
 }
 
-#define swap_state_tables                                                     \
-    do {                                                                      \
-        t = reg->state;                                                       \
-        reg->state = reg->state_next;                                         \
-        reg->state_next = t;                                                  \
-    } while (0)
+#define text_at(i) ((i) < size0 ? text0[i] : text1[(i) - size0])
 
-#define clear_state_table(tb) memset(tb, '\0', ns->i)
+#define sol_at(i)                                                             \
+    ((i) ? !reg->nl_ins && text_at((i) - 1) == '\n' : sol)
 
-#define check_for_winner                                                      \
+#define eol_at(i)                                                             \
+    ((i) == size0 + size1 || (!reg->nl_ins && text_at(i) == '\n'))
+
+#define add_rev_closure(z, k)                                                 \
     do {                                                                      \
-        if (reg->state_next[reg->nfa_end]) {                                  \
-            /*                                                                \
-             * End node is in state. Record the match. Regex takes the        \
-             * longest match, so OK to overwrite any previous match.          \
-             */                                                               \
-            last_match = p;                                                   \
-        } else {                                                              \
-            count = 0;                                                        \
-            for (i = 0; i < ns->i; ++i)                                       \
-                if (reg->state_next[i])                                       \
-                    ++count;                                                  \
-                                                                              \
-            if (!count) { /* All nodes out */                                 \
-                goto report;                                                  \
-            }                                                                 \
+        c = reg->rcl + reg->rcl_off[k];                                       \
+        c_stop = reg->rcl + reg->rcl_off[(k) + 1];                            \
+        while (c != c_stop) {                                                 \
+            add_to_set(z, *c);                                                \
+            ++c;                                                              \
         }                                                                     \
     } while (0)
 
-#define print_state_tables                                                    \
-    for (i = 0; i < ns->i; ++i)                                               \
-    fprintf(stderr, "Node %lu: %d %d\n", (unsigned long) i, reg->state[i],    \
-        reg->state_next[i])
-
-static char *run_nfa(const char *text, size_t text_size, int sol,
-    struct regex *reg, size_t *match_len, int verbose)
+static int rev_search(struct regex *reg, const char *text0, size_t size0,
+    const char *text1, size_t size1, int sol, size_t from,
+    size_t *match_offset, size_t *match_len, int verbose)
 {
-    /* Does not advance */
-    struct nfa_storage *ns;
-    unsigned char *t;
-    const char *p, *last_match = NULL;
+    /*
+     * Runs the reversed automaton from offset from towards the start of the
+     * text. All end positions are tried in one right-to-left pass, so the
+     * first position that a match can commence from is the closest one.
+     * The NFA is then run forwards from there, up to from, for the length
+     * of the match.
+     * The cost depends on the distance scanned, not the size of the text.
+     */
+    struct nfa_storage *ns = reg->ns;
+    struct sparse_set *z, *k, *t;
+    const size_t *c, *c_stop;
+    size_t p, i, x, mo, steps = 0, peak = 0;
     unsigned char u;
-    size_t s, i, count;
-    int diff, eol = 0;
+    int s, eot, found, r, ret = NO_MATCH;
 
-    ns = reg->ns; /* Make a shortcut so that lk works */
-    p = text;
-    s = text_size;
+    z = reg->rev_ss;
+    k = reg->rev_kern;
+    z->i = 0;
+    p = from;
+    eot = eol_at(from);
 
-    if (verbose) {
-        fprintf(stderr, "=== Start of NFA run ===\n");
-        fprintf(stderr, "Start node: %lu\nEnd node: %lu\n", reg->nfa_start,
-            reg->nfa_end);
-    }
+    while (1) {
+        /* Matches can end here */
+        add_rev_closure(z, ns->i + eol_at(p));
 
-    /* Clear state tables */
-    clear_state_table(reg->state);
-    clear_state_table(reg->state_next);
+        if (!p)
+            break;
 
-    /* Set start node */
-    reg->state[reg->nfa_start] = 1;
+        u = text_at(p - 1);
+        s = sol_at(p - 1);
+        found = 0;
+        k->i = 0;
 
-    while (1) {
-        /*
-         * sol is initially inherited from the function call, as it is
-         * internally unknown if text is at the start of the greater context
-         * line. This is because this function will be called repetitively
-         * by an advancing wrapper.
-         */
+        steps += z->i;
+        if (z->i > peak)
+            peak = z->i;
 
-        /*
-         * Set end of line read status.
-         * Note that the character \n cannot match when in newline sensitive
-         * (not insensitive) mode, as the process will stop before it is read.
-         */
-        if (!s || (*p == '\n' && !reg->nl_ins))
-            eol = 1;
+        /* The \n cannot be read in newline sensitive mode */
+        if (reg->nl_ins || u != '\n') {
+            for (i = 0; i < z->i; ++i) {
+                x = z->dense[i];
+                if (cs_test(lk_cs(x), u)) {
+                    if (reg->rev_start[x] & 1 << s)
+                        found = 1;
 
-        /*
-         * Move without reading a character from text. States are additive.
-         * Stop when no new states are being added.
-         */
-        while (1) {
-            for (i = 0; i < ns->i; ++i) {
-                if (reg->state[i]) {
-                    reg->state_next[i] = 1; /* Accumulative */
-                    if (lk(i).link_type == EPSILON
-                        || lk(i).link_type == BOTH_EPSILON
-                        || (lk(i).link_type == SOL_READ_STATUS && sol)
-                        || (lk(i).link_type == EOL_READ_STATUS && eol))
-                        reg->state_next[lk(i).link0] = 1;
-
-                    if (lk(i).link_type == BOTH_EPSILON)
-                        reg->state_next[lk(i).link1] = 1;
+                    add_rev_closure(k, x);
                 }
             }
+        }
 
-            diff = 0;
-
-            if (verbose) {
-                fprintf(stderr, "No read:\n");
-                print_state_tables;
+        --p;
+        t = z;
+        z = k;
+        k = t;
+
+        if (found || reg->rev_empty[s][eol_at(p)]) {
+            if (verbose)
+                fprintf(stderr, "Reversed automaton: Match commences at %lu\n",
+                    (unsigned long) p);
+
+            /* Cut off at from, so that the match cannot end after it */
+            if (from <= size0)
+                r = run_nfa(text0 + p, from - p, NULL, 0, s, eot, reg, 0, &mo,
+                    match_len, verbose);
+            else if (p < size0)
+                r = run_nfa(text0 + p, size0 - p, text1, from - size0, s, eot,
+                    reg, 0, &mo, match_len, verbose);
+            else
+                r = run_nfa(text1 + (p - size0), from - p, NULL, 0, s, eot,
+                    reg, 0, &mo, match_len, verbose);
+
+            if (r == MATCH) {
+                *match_offset = p;
+                ret = 0;
+                break;
             }
+        }
+    }
 
-            /* Check if the states are the same */
-            for (i = 0; i < ns->i; ++i)
-                if (reg->state[i] != reg->state_next[i]) {
-                    diff = 1;
-                    break;
-                }
+    if (reg->stats != NULL) {
+        reg->stats->bytes_scanned += from - p;
+        reg->stats->nfa_steps += steps;
+        if (peak > reg->stats->peak_active)
+            reg->stats->peak_active = peak;
+    }
 
-            /* Stops infinite loops */
-            if (!diff)
-                break;
+    return ret;
+}
 
-            swap_state_tables;
-            clear_state_table(reg->state_next);
-        }
+#undef text_at
+#undef sol_at
+#undef eol_at
+#undef add_rev_closure
 
-        /* State tables are the same now */
+int regex_exec_backward(struct regex *reg, const char *text0, size_t size0,
+    const char *text1, size_t size1, int sol, size_t from, int wrap,
+    size_t *match_offset, size_t *match_len, int verbose)
+{
+    /*
+     * Finds the match that commences closest before offset from, and ends
+     * at or before it, in the text formed by text0 followed by text1. If wrap
+     * is set, and there is none, the search wraps around to the end of the
+     * text. sol is the start of line status of the start of text0. The offset
+     * of the match is relative to the start of text0.
+     */
+    if (reg == NULL || text0 == NULL || text1 == NULL || from > size0 + size1)
+        return USAGE_ERROR;
 
-        check_for_winner;
+    if (!rev_search(reg, text0, size0, text1, size1, sol, from, match_offset,
+            match_len, verbose))
+        return 0;
 
-        if (eol)
-            goto report;
+    if (!wrap || from == size0 + size1)
+        return NO_MATCH;
 
-        /* Read a char */
-        u = *p++;
-        --s;
+    return rev_search(reg, text0, size0, text1, size1, sol, size0 + size1,
+        match_offset, match_len, verbose);
+}
 
-        /* Deactivate start of line read status after first read */
-        sol = 0;
+static int replace_from(struct regex_iter *it, size_t mo, size_t ml,
+    const char *text, size_t text_size, const char *replace,
+    size_t replace_size, struct obuf *output, int verbose)
+{
+    /*
+     * Copies the text to output, replacing the match at mo, and the rest of
+     * the matches that the iterator finds after it.
+     */
+    size_t copied = 0;
 
-        if (verbose)
-            fprintf(stderr, "Read char: %c\n", u);
+    do {
+        /* Print text before match, then the replacement text */
+        if (put_mem(output, text + copied, mo - copied))
+            mreturn(1);
 
-        clear_state_table(reg->state_next);
+        if (put_mem(output, replace, replace_size))
+            mreturn(1);
 
-        /* Advance or be eliminated */
-        for (i = 0; i < ns->i; ++i)
-            if (reg->state[i])
-                if (lk(i).link_type == CHAR_SET && lk(i).char_set[u])
-                    reg->state_next[lk(i).link0] = 1;
+        copied = mo + ml;
+    } while (!regex_iter_next(it, &mo, &ml, verbose));
 
-        if (verbose)
-            print_state_tables;
+    /* Print rest of text */
+    if (put_mem(output, text + copied, text_size - copied))
+        mreturn(1);
 
-        check_for_winner;
+    return 0;
+}
 
-        swap_state_tables;
-        clear_state_table(reg->state_next);
-    }
+static int replace_range(struct regex *reg, const char *text,
+    size_t text_size, const char *replace, size_t replace_size,
+    struct obuf *output, int verbose)
+{
+    struct regex_iter it;
+    size_t mo, ml;
 
-report:
+    if (regex_iter_init(&it, reg, text, text_size, NULL, 0, 1, 0))
+        mreturn(1);
 
-    /* End of text */
-    if (last_match == NULL) {
-        if (verbose)
-            fprintf(stderr, " => NO MATCH\n");
+    if (regex_iter_next(&it, &mo, &ml, verbose)) {
+        if (put_mem(output, text, text_size))
+            mreturn(1);
 
-        return NULL;
+        return 0;
     }
 
-    *match_len = last_match - text;
+    return replace_from(&it, mo, ml, text, text_size, replace, replace_size,
+        output, verbose);
+}
 
-    if (verbose)
-        fprintf(stderr, " => MATCH\n");
+static void add_regex_stats(struct regex_stats *a, const struct regex_stats *b)
+{
+    a->searches += b->searches;
+    a->bytes_scanned += b->bytes_scanned;
+    a->starts += b->starts;
+    a->nfa_steps += b->nfa_steps;
+    if (b->peak_active > a->peak_active)
+        a->peak_active = b->peak_active;
+
+    a->prefilter_skips += b->prefilter_skips;
+    a->bytes_skipped += b->bytes_skipped;
+    a->dfa_hits += b->dfa_hits;
+    a->dfa_misses += b->dfa_misses;
+    a->dfa_flushes += b->dfa_flushes;
+}
 
-    return (char *) text;
+void set_regex_replace_threads(size_t n)
+{
+    /*
+     * Sets the number of threads that regex_exec_replace can use for large
+     * text in newline sensitive mode. One (or zero) keeps it single-threaded.
+     */
+    replace_threads = n > REPLACE_MAX_THREADS ? REPLACE_MAX_THREADS : n;
 }
 
-#undef swap_state_tables
-#undef clear_state_table
-#undef check_for_winner
-#undef print_state_tables
+#ifdef _WIN32
+static unsigned __stdcall replace_worker(void *arg)
+#else
+static void *replace_worker(void *arg)
+#endif
+{
+    struct replace_job *j = (struct replace_job *) arg;
 
-static char *internal_regex_search(const char *text, size_t text_size, int sol,
-    struct regex *reg, size_t *match_len, int verbose)
+    j->ret = replace_range(&j->reg, j->text, j->text_size, j->replace,
+                 j->replace_size, j->output, 0)
+        || (j->nl && put_ch(j->output, '\n'));
+
+    return 0;
+}
+
+static int parallel_replace(struct regex *reg, const char *text,
+    size_t text_size, const char *replace, size_t replace_size,
+    struct obuf *output)
 {
-    /* Advances */
-    const char *q;
-    size_t ts;
-    char *match = NULL;
-    size_t ml; /* Match length */
+    /*
+     * In newline sensitive mode a match cannot cross a line, and the search
+     * starts over at the start of every line. So the text is split into
+     * chunks at line boundaries, which are replaced on their own threads, and
+     * the results are joined in order. The \n that ends a chunk is left out
+     * of its search, so that the end of the chunk is not taken to be the end
+     * of the line, and is then passed through.
+     */
+    int ret = 1;
+    struct replace_job *job = NULL;
+#ifdef _WIN32
+    HANDLE *th = NULL;
+#else
+    pthread_t *th = NULL;
+#endif
+    unsigned char *running = NULL;
+    const char *p, *q, *t, *stop = text + text_size;
+    size_t num, n = 0, k;
+
+    num = text_size / REPLACE_CHUNK_MIN;
+    if (num > replace_threads)
+        num = replace_threads;
+
+    if ((job = calloc(num, sizeof(struct replace_job))) == NULL)
+        mgoto(clean_up);
 
-    q = text;
-    ts = text_size;
-    while ((match = run_nfa(q, ts, sol, reg, &ml, verbose)) == NULL) {
-        if (!reg->nl_ins && *q == '\n')
-            sol = 1;
-        else
-            sol = 0;
+    if ((th = calloc(num, sizeof(*th))) == NULL)
+        mgoto(clean_up);
+
+    if ((running = calloc(num, 1)) == NULL)
+        mgoto(clean_up);
+
+    /* Split at line boundaries. The last chunk runs to the end. */
+    p = text;
+    for (n = 0; n + 1 < num; ++n) {
+        t = text + text_size / num * (n + 1);
+        if (t < p)
+            t = p;
 
-        if (!ts)
+        if ((q = memchr(t, '\n', stop - t)) == NULL)
             break;
 
-        ++q;
-        --ts;
+        job[n].text = p;
+        job[n].text_size = q - p;
+        job[n].nl = 1;
+        p = q + 1;
     }
+    job[n].text = p;
+    job[n].text_size = stop - p;
+    ++n;
 
-    if (verbose)
-        fprintf(stderr, "=== Search result ===\n");
+    for (k = 0; k < n; ++k) {
+        job[k].reg = *reg;
+        if (init_scratch(&job[k].reg, reg->dfa != NULL))
+            mgoto(clean_up);
 
-    if (match == NULL) {
-        if (verbose)
-            fprintf(stderr, "No match\n");
+        /* Each thread records its own statistics, which are added up after */
+        if (reg->stats != NULL)
+            job[k].reg.stats = &job[k].stats;
 
-        return NULL;
+        job[k].replace = replace;
+        job[k].replace_size = replace_size;
+        job[k].ret = 1;
+        if (!k)
+            job[k].output = output;
+        else if ((job[k].output = init_obuf(job[k].text_size + 1)) == NULL)
+            mgoto(clean_up);
     }
 
-    if (verbose) {
-        fprintf(stderr, "match_offset: %lu\n", match - text);
-        fprintf(stderr, "match_len: %lu\n", ml);
+    /* The first chunk is done on this thread */
+    for (k = 1; k < n; ++k) {
+#ifdef _WIN32
+        th[k] = (HANDLE) _beginthreadex(
+            NULL, 0, replace_worker, job + k, 0, NULL);
+        running[k] = th[k] != 0;
+#else
+        running[k] = !pthread_create(th + k, NULL, replace_worker, job + k);
+#endif
+        /* Fall back to doing it here */
+        if (!running[k])
+            replace_worker(job + k);
     }
 
-    *match_len = ml;
-    return match;
+    replace_worker(job);
+
+    for (k = 1; k < n; ++k) {
+        if (running[k]) {
+#ifdef _WIN32
+            WaitForSingleObject(th[k], INFINITE);
+            CloseHandle(th[k]);
+#else
+            pthread_join(th[k], NULL);
+#endif
+            running[k] = 0;
+        }
+    }
+
+    for (k = 0; k < n; ++k) {
+        if (job[k].ret)
+            mgoto(clean_up);
+
+        if (k && put_obuf(output, job[k].output))
+            mgoto(clean_up);
+
+        if (reg->stats != NULL)
+            add_regex_stats(reg->stats, &job[k].stats);
+    }
+
+    ret = 0;
+
+clean_up:
+    if (job != NULL) {
+        for (k = 0; k < n; ++k) {
+            free_scratch(&job[k].reg);
+            if (k)
+                free_obuf(job[k].output);
+        }
+    }
+
+    free(job);
+    free(th);
+    free(running);
+
+    return ret;
 }
 
-int regex_search(const char *text, size_t text_size, int sol,
-    const char *regex_str, int nl_ins, int case_ins, size_t *match_offset,
-    size_t *match_len, int verbose)
+int regex_exec_replace_to(struct regex *reg, const char *text,
+    size_t text_size, const char *replace_str, struct obuf *output,
+    int verbose)
 {
+    /*
+     * Repeated search and replace, appending the result to output.
+     * Returns NO_MATCH, without writing anything, when there is nothing to
+     * replace, so the caller can keep using the text as it is.
+     * Large text in newline sensitive mode is split over multiple threads,
+     * see set_regex_replace_threads.
+     */
     int ret = 1;
-    struct regex *reg = NULL;
-    char *m;
-    size_t ml;
+    char *replace_esc = NULL;
+    size_t replace_esc_size, out_start, mo, ml, ls;
+    struct regex_iter it;
 
-    if (text == NULL) {
-        ret = USAGE_ERROR;
-        mgoto(clean_up);
-    }
+    if (reg == NULL || text == NULL || output == NULL)
+        return USAGE_ERROR;
 
-    if ((ret = compile_regex(regex_str, nl_ins, case_ins, &reg, verbose)))
-        mgoto(clean_up);
+    out_start = output->i;
 
-    if (reg == NULL)
+    if ((ret = interpret_escaped_chars(
+             replace_str, &replace_esc, &replace_esc_size)))
         mgoto(clean_up);
 
-    m = internal_regex_search(text, text_size, sol, reg, &ml, verbose);
+    ret = 1;
 
-    if (m == NULL) {
+    if (regex_iter_init(&it, reg, text, text_size, NULL, 0, 1, 0))
+        mgoto(clean_up);
+
+    /* Do not run NFA if there is no input text */
+    if (!text_size || regex_iter_next(&it, &mo, &ml, verbose)) {
         ret = NO_MATCH;
         goto clean_up;
     }
 
-    *match_offset = m - text;
-    *match_len = ml;
+    if (!reg->nl_ins && !verbose && replace_threads > 1
+        && (text_size - mo) / REPLACE_CHUNK_MIN > 1) {
+        /* Pass through the lines before the first match */
+        ls = mo;
+        while (ls && text[ls - 1] != '\n') --ls;
+
+        if (put_mem(output, text, ls))
+            mgoto(clean_up);
+
+        if (parallel_replace(reg, text + ls, text_size - ls, replace_esc,
+                replace_esc_size, output))
+            mgoto(clean_up);
+
+    } else if (replace_from(&it, mo, ml, text, text_size, replace_esc,
+                   replace_esc_size, output, verbose)) {
+        mgoto(clean_up);
+    }
 
     ret = 0;
 
 clean_up:
-    free_regex(reg);
+    free(replace_esc);
+
+    if (ret && ret != NO_MATCH)
+        output->i = out_start; /* Drop any partial result */
 
     return ret;
 }
 
-int regex_replace(const char *text, size_t text_size, const char *regex_str,
-    int nl_ins, int case_ins, const char *replace_str, char **result,
-    size_t *result_len, int verbose)
+int regex_exec_replace(struct regex *reg, const char *text, size_t text_size,
+    const char *replace_str, char **result, size_t *result_len, int verbose)
 {
     /*
      * Repeated search and replace. The result is \0 terminated and the length
@@ -1424,112 +3841,174 @@ int regex_replace(const char *text, size_t text_size, const char *regex_str,
      * However, the result might have embedded \0 chars.
      */
     int ret = 1;
-    struct regex *reg = NULL;
-    char *replace_esc = NULL;
-    size_t replace_esc_size;
     struct obuf *output = NULL;
 
-    int sol;
-    const char *q;
-    const char *q_stop; /* Exclusive */
-    char *m, *m_last_end;
-    size_t ml;
+    if (reg == NULL || text == NULL)
+        return USAGE_ERROR;
+
+    if (text_size == SIZE_MAX)
+        mreturn(1);
+
+    /* Grows as needed */
+    if ((output = init_obuf(text_size + 1)) == NULL)
+        mreturn(1);
+
+    ret = regex_exec_replace_to(
+        reg, text, text_size, replace_str, output, verbose);
 
-    if (text == NULL) {
-        ret = USAGE_ERROR;
+    if (ret == NO_MATCH) {
+        if (put_mem(output, text, text_size))
+            mgoto(clean_up);
+    } else if (ret) {
         mgoto(clean_up);
     }
 
-    if ((ret = compile_regex(regex_str, nl_ins, case_ins, &reg, verbose)))
-        mgoto(clean_up);
+    ret = 1;
 
-    if (reg == NULL)
+    /* Terminate */
+    if (put_ch(output, '\0'))
         mgoto(clean_up);
 
-    if ((ret = interpret_escaped_chars(
-             replace_str, &replace_esc, &replace_esc_size)))
-        mgoto(clean_up);
+    ret = 0;
+    *result = output->a;
+    *result_len = output->i - 1;
 
-    if (text_size > SIZE_MAX / 2)
-        mgoto(clean_up);
+clean_up:
+    if (ret)
+        free_obuf(output);
+    else
+        free_obuf_exterior(output);
 
-    if ((output = init_obuf(text_size * 2)) == NULL)
-        mgoto(clean_up);
+    return ret;
+}
 
-    /* Do not run NFA if there is no input text */
-    if (!text_size)
-        goto finish;
+void free_regex_cache(void)
+{
+    size_t i;
 
-    q = text;
-    q_stop = q + text_size;
-    sol = 1;
-    m_last_end = NULL;
-    while (1) {
-        /* Recheck start of line read status */
-        if (q != text && *(q - 1) == '\n' && !nl_ins) {
-            sol = 1;
-            m_last_end = NULL;
+    for (i = 0; i < regex_cache_i; ++i) {
+        free(regex_cache[i].regex_str);
+        regex_free(regex_cache[i].reg);
+    }
+    regex_cache_i = 0;
+}
+
+static int cached_regex_compile(const char *regex_str, int nl_ins,
+    int case_ins, struct regex **regex_st, int verbose)
+{
+    /*
+     * Looks up the compiled regex in the LRU cache, compiling it upon a miss.
+     * The cache retains ownership of the handle.
+     */
+    int ret;
+    size_t i;
+    struct regex_cache_entry e;
+
+    if (regex_str == NULL)
+        return USAGE_ERROR;
+
+    for (i = 0; i < regex_cache_i; ++i) {
+        e = regex_cache[i];
+        if (e.nl_ins == nl_ins && e.case_ins == case_ins
+            && !strcmp(e.regex_str, regex_str)) {
+            ++regex_cache_hits;
+            /* Move to front */
+            memmove(regex_cache + 1, regex_cache,
+                i * sizeof(struct regex_cache_entry));
+            regex_cache[0] = e;
+            goto done;
         }
+    }
 
-        m = internal_regex_search(q, q_stop - q, sol, reg, &ml, verbose);
+    ++regex_cache_misses;
 
-        if (m == NULL) {
-            /* Print rest of text */
-            if (put_mem(output, q, q_stop - q))
-                mgoto(clean_up);
+    if ((ret = regex_compile(regex_str, nl_ins, case_ins, &e.reg, verbose)))
+        mreturn(ret);
 
-            break;
-        }
+    if ((e.regex_str = strdup(regex_str)) == NULL) {
+        regex_free(e.reg);
+        mreturn(1);
+    }
 
-        /* Print text before match */
-        if (put_mem(output, q, m - q))
-            mgoto(clean_up);
+    e.nl_ins = nl_ins;
+    e.case_ins = case_ins;
 
-        /* Print replacement text */
-        if (!(!ml && m == m_last_end)
-            && put_mem(output, replace_esc, replace_esc_size))
-            mgoto(clean_up);
+    /* Evict the least recently used */
+    if (regex_cache_i == REGEX_CACHE_SIZE) {
+        --regex_cache_i;
+        free(regex_cache[regex_cache_i].regex_str);
+        regex_free(regex_cache[regex_cache_i].reg);
+    }
 
-        /* Stop after running on the zero length input */
-        if (q == q_stop)
-            break;
+    memmove(regex_cache + 1, regex_cache,
+        regex_cache_i * sizeof(struct regex_cache_entry));
+    regex_cache[0] = e;
+    ++regex_cache_i;
 
-        /* Advance */
-        if (ml) {
-            q = m + ml;
-        } else {
-            if (m == q_stop)
-                break;
+done:
+    if (verbose)
+        fprintf(stderr, "Regex cache: %lu hits, %lu misses\n",
+            regex_cache_hits, regex_cache_misses);
 
-            /* Jump forward a char, but pass it through */
-            if (put_mem(output, m, 1))
-                mgoto(clean_up);
+    /* May have been compiled before set_regex_stats was called */
+    e.reg->stats = stats_sink;
 
-            q = m + 1;
-        }
+    *regex_st = e.reg;
+    return 0;
+}
 
-        sol = 0;
-        m_last_end = m + ml;
-    }
+int regex_search(const char *text, size_t text_size, int sol,
+    const char *regex_str, int nl_ins, int case_ins, size_t *match_offset,
+    size_t *match_len, int verbose)
+{
+    /* Uses the cache of compiled regexes */
+    int ret;
+    struct regex *reg = NULL;
 
-finish:
+    if (text == NULL)
+        return USAGE_ERROR;
 
-    /* Terminate */
-    if (put_ch(output, '\0'))
-        mgoto(clean_up);
+    if ((ret = cached_regex_compile(
+             regex_str, nl_ins, case_ins, &reg, verbose)))
+        mreturn(ret);
 
-    ret = 0;
-    *result = output->a;
-    *result_len = output->i - 1;
+    return regex_exec(
+        reg, text, text_size, sol, match_offset, match_len, verbose);
+}
 
-clean_up:
-    free_regex(reg);
-    free(replace_esc);
+int regex_replace_to(const char *text, size_t text_size,
+    const char *regex_str, int nl_ins, int case_ins, const char *replace_str,
+    struct obuf *output, int verbose)
+{
+    /* Streaming version of regex_replace. See regex_exec_replace_to. */
+    int ret;
+    struct regex *reg = NULL;
 
-    if (ret)
-        free_obuf(output);
-    else
-        free_obuf_exterior(output);
+    if (text == NULL)
+        return USAGE_ERROR;
 
-    return ret;
+    if ((ret = cached_regex_compile(
+             regex_str, nl_ins, case_ins, &reg, verbose)))
+        mreturn(ret);
+
+    return regex_exec_replace_to(
+        reg, text, text_size, replace_str, output, verbose);
+}
+
+int regex_replace(const char *text, size_t text_size, const char *regex_str,
+    int nl_ins, int case_ins, const char *replace_str, char **result,
+    size_t *result_len, int verbose)
+{
+    int ret;
+    struct regex *reg = NULL;
+
+    if (text == NULL)
+        return USAGE_ERROR;
+
+    if ((ret = cached_regex_compile(
+             regex_str, nl_ins, case_ins, &reg, verbose)))
+        mreturn(ret);
+
+    return regex_exec_replace(
+        reg, text, text_size, replace_str, result, result_len, verbose);
 }
@@ -61,10 +61,13 @@
 #include <fcntl.h>
 #include <io.h>
 #include <process.h>
+#include <psapi.h>
 #else
 #include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -80,17 +83,38 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Vector instructions for scanning. SSE2 is used when the compiler targets
+ * it, and AVX2 when the processor supports it at runtime. See gen.c.
+ */
+#if defined(__SSE2__) || defined(_M_X64)                                      \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #ifdef _WIN32
 #define popen  _popen
 #define pclose _pclose
 #endif
 
 #ifdef _WIN32
-#define stat_f _stat64
-#define stat_s __stat64
+#define stat_f  _stat64
+#define fstat_f _fstat64
+#define stat_s  __stat64
 #else
-#define stat_f stat
-#define stat_s stat
+#define stat_f  stat
+#define fstat_f fstat
+#define stat_s  stat
 #endif
 
 #ifndef S_ISREG
@@ -165,6 +189,15 @@
 /* For printing a number as a string */
 #define NUM_BUF_SIZE 32
 
+/* Members that a byte set keeps in a list. See init_byte_set. */
+#define BYTE_SET_LIST_MAX 4
+
+/* For printing regex statistics as a string. See regex_stats_to_str. */
+#define REGEX_STATS_BUF_SIZE 512
+
+/* Changes whenever struct regex_tables does. See regex_load. */
+#define REGEX_TABLES_VERSION 1
+
 #define NUM_OPERATORS 25
 
 /* Parentheses */
@@ -230,8 +263,22 @@
 
 typedef int (*Fptr)(void *);
 
+/*
+ * Text pushed back by reference, which is read forwards. See unget_obuf.
+ * The frame is read when the ibuf write index comes down to base.
+ */
+struct ibuf_frame {
+    const char *start;
+    const char *p;    /* Next character */
+    const char *stop; /* Exclusive */
+    char *own;        /* Memory that the frame owns, or NULL */
+    size_t own_n;     /* Allocated size of own, if known, otherwise 0 */
+    size_t base;      /* Write index of the ibuf when the frame was pushed */
+};
+
 /*
  * Input buffer: Characters are stored in reverse order.
+ * Longer text is pushed back as a frame, without reversing it.
  * Unget file links in a new struct at the head.
  * Operated on by get and unget functions.
  */
@@ -245,9 +292,18 @@ struct ibuf {
      * increment until the character after is read.
      */
     size_t rn;
-    char *a;           /* Memory */
-    size_t i;          /* Write index */
-    size_t n;          /* Allocated number of elements */
+    char *a;               /* Memory */
+    size_t i;              /* Write index */
+    size_t n;              /* Allocated number of elements */
+    struct ibuf_frame *fr; /* Stack of frames */
+    size_t fr_i;           /* Number of frames */
+    size_t fr_n;           /* Allocated number of frames */
+    char *spare;           /* Memory of a finished frame, for reuse */
+    size_t spare_n;
+    int block;   /* The stream is read a block at a time */
+    char *rb;    /* Block read from the stream, read forwards */
+    size_t rb_i; /* Read index */
+    size_t rb_len;
     struct ibuf *next; /* Link to next struct */
 };
 
@@ -328,6 +384,7 @@ struct gb {
 /* Hash table entry */
 struct entry {
     char *name;         /* Macro name */
+    size_t h;           /* Full hash of name */
     char *def;          /* User-defined macro definition */
     Fptr func_p;        /* Function Pointer */
     struct entry *hist; /* For entry history */
@@ -335,20 +392,135 @@ struct entry {
     struct entry *next; /* Next entry in collision chain */
 };
 
+/* Set of bytes, laid out for scanning. See init_byte_set. */
+struct byte_set {
+    unsigned char in[UCHAR_MAX + 1]; /* Membership, filled in by the caller */
+    size_t num;                      /* Number of members */
+    unsigned char list[BYTE_SET_LIST_MAX]; /* The members, when few */
+    /*
+     * Bit (high nibble & 7) of lo[low nibble] is set for each member under
+     * 0x80, and of hi[low nibble] for each member from 0x80 up.
+     */
+    unsigned char lo[16];
+    unsigned char hi[16];
+};
+
+/* Slots in the hash table name filter. Must be a power of two. */
+#define HT_FILTER_SIZE 4096
+
 /* Hash table */
 struct ht {
     struct entry **b; /* Buckets */
-    size_t n;         /* Number of buckets */
+    size_t n;         /* Number of buckets. Always a power of two. */
+    size_t min_n;     /* The table does not shrink below this */
+    size_t num;       /* Number of names stored (not counting history) */
+    /*
+     * Number of names keyed to each slot by their first byte, last byte and
+     * length. A zero slot means that no such name is in the table.
+     */
+    size_t filter[HT_FILTER_SIZE];
+};
+
+/* Compiled set of literals. Opaque, see multi_lit_compile. */
+struct multi_lit;
+
+/* Compiled regex. Opaque, see toco_regex.c */
+struct regex;
+
+/* Iterates over the matches of a regex. See regex_iter_init. */
+struct regex_iter {
+    struct regex *reg;
+    const char *text0;
+    size_t size0;
+    const char *text1; /* Text continues here after text0 */
+    size_t size1;
+    size_t pos;      /* Offset where the next search commences */
+    int sol;         /* Start of line read status at pos */
+    int last_set;    /* A match has been found */
+    size_t last_end; /* Offset of the end of the last match */
+    int done;
+};
+
+/* Regex search statistics. See set_regex_stats. */
+struct regex_stats {
+    size_t searches;        /* Unanchored searches run */
+    size_t bytes_scanned;   /* Bytes read one at a time by an automaton */
+    size_t starts;          /* Start positions tried by the NFA */
+    size_t nfa_steps;       /* In-state nodes tested against a byte */
+    size_t peak_active;     /* Most in-state nodes at once */
+    size_t prefilter_skips; /* Times that the prefilter jumped ahead */
+    size_t bytes_skipped;   /* Bytes jumped over */
+    size_t dfa_hits;        /* Cached DFA transitions taken */
+    size_t dfa_misses;      /* DFA transitions that had to be built */
+    size_t dfa_flushes;     /* Times that a DFA cache was emptied */
+};
+
+/*
+ * Compiled regex as constant data, written by regex_write_tables (see
+ * regex_gen) and made into a handle by regex_load. The arrays mirror the
+ * fields of struct regex of the same names.
+ */
+struct regex_tables {
+    int version; /* REGEX_TABLES_VERSION */
+    int nl_ins;
+    size_t node_num;
+    const unsigned char *type;
+    const size_t *link0;
+    const size_t *link1;
+    const size_t *cs;
+    size_t cs_num;
+    const unsigned char *cs_store;
+    const unsigned char *byte_class;
+    size_t num_classes;
+    size_t nfa_start;
+    size_t nfa_end;
+    const size_t *cl;
+    const size_t *cl_off;
+    const size_t *rcl;
+    const size_t *rcl_off;
+    const unsigned char *rev_start;
+    unsigned char rev_empty[2][2];
+    int anchored;
+    int no_empty;
+    const unsigned char *first; /* Membership of the first byte set */
+    const unsigned char *prefix;
+    size_t prefix_len;
+    const unsigned char *req;
+    size_t req_len;
+    int bp;
+    size_t bp_num;
+    const unsigned long *bp_b;
+    const unsigned long *bp_follow;
+    size_t bp_follow_num;
+    unsigned long bp_start[2];
+    unsigned long bp_final[2];
+    unsigned char bp_empty[2][2];
 };
 
 /* Function declarations */
 int binary_io(void);
 char *concat(const char *str, ...);
+void init_byte_set(struct byte_set *s);
+const char *scan_byte_set(
+    const struct byte_set *s, const char *p, const char *p_stop);
 void *quick_search(
     const void *mem, size_t mem_len, const void *find, size_t find_len);
+int quick_search_split(const void *mem0, size_t len0, const void *mem1,
+    size_t len1, const void *find, size_t find_len, size_t from, int wrap,
+    size_t *offset);
+int quick_search_backward(const void *mem0, size_t len0, const void *mem1,
+    size_t len1, const void *find, size_t find_len, size_t from, int wrap,
+    size_t *offset);
+int multi_lit_compile(const char **lit, const size_t *lit_len, size_t num,
+    struct multi_lit **ml);
+int multi_lit_search(const struct multi_lit *m, const char *text,
+    size_t size, size_t *match_offset, size_t *match_len, size_t *lit_index);
+void multi_lit_free(struct multi_lit *m);
 FILE *fopen_w(const char *fn, int append);
 int tty_check(FILE *stream, int *is_tty);
 int milli_sleep(long milliseconds);
+size_t num_cpus(void);
+int peak_mem(size_t *bytes);
 int random_uint(unsigned int *x);
 int random_num(unsigned int max_inclusive, unsigned int *x);
 int str_to_num(const char *str, unsigned long max_val, unsigned long *res);
@@ -362,11 +534,16 @@ struct ibuf *init_ibuf(size_t n);
 int free_ibuf(struct ibuf *b);
 int unget_ch(struct ibuf *b, char ch);
 int unget_str(struct ibuf *b, const char *str);
+int unget_own(struct ibuf *b, char *mem, size_t len);
+int unget_obuf(struct ibuf *b, struct obuf *t);
 int unget_stream(struct ibuf **b, FILE *fp, const char *nm);
 int unget_file(struct ibuf **b, const char *fn);
 int append_stream(struct ibuf **b, FILE *fp, const char *nm);
 int append_file(struct ibuf **b, const char *fn);
 int get_ch(struct ibuf **input, char *ch);
+int peek_ch(struct ibuf **input, char *ch);
+int get_run(struct ibuf *b, const struct byte_set *stop, struct obuf *out,
+    size_t *len);
 int eat_whitespace(struct ibuf **input);
 int delete_to_nl(struct ibuf **input);
 int eat_str_if_match(struct ibuf **input, const char *str);
@@ -415,8 +592,11 @@ int goto_row(struct gb *b, struct gb *cl);
 int insert_hex(struct gb *b, struct gb *cl);
 void set_mark(struct gb *b);
 int swap_cursor_and_mark(struct gb *b);
+int set_cursor(struct gb *b, size_t x);
 int exact_forward_search(struct gb *b, struct gb *cl);
-int regex_forward_search(struct gb *b, struct gb *cl, int case_ins);
+int regex_forward_search(struct gb *b, struct regex *reg);
+int exact_backward_search(struct gb *b, struct gb *cl);
+int regex_backward_search(struct gb *b, struct regex *reg);
 int regex_replace_region(struct gb *b, struct gb *cl, int case_ins);
 int match_bracket(struct gb *b);
 int trim_clean(struct gb *b);
@@ -436,17 +616,52 @@ int eval_ibuf(struct ibuf **input, long *res, int verbose);
 int eval_str(const char *math_str, long *res, int verbose);
 struct ht *init_ht(size_t num_buckets);
 void free_ht(struct ht *ht);
+int may_exist(const struct ht *ht, const char *name, size_t len);
 struct entry *lookup(struct ht *ht, const char *name);
 int delete_entry(struct ht *ht, const char *name, int pop_hist);
 int upsert(struct ht *ht, const char *name, const char *def, Fptr func_p,
     int push_hist);
+void regex_free(struct regex *reg);
+int regex_compile(const char *regex_str, int nl_ins, int case_ins,
+    struct regex **regex_st, int verbose);
+int regex_write_tables(struct regex *reg, const char *name, FILE *fp);
+int regex_load(const struct regex_tables *t, struct regex **regex_st);
+void set_regex_dfa_mem_limit(size_t limit);
+void set_regex_stats(struct regex_stats *st);
+int regex_stats_to_str(
+    const struct regex_stats *st, char *buf, size_t buf_size);
+size_t regex_mem_size(struct regex *reg);
+int regex_exec(struct regex *reg, const char *text, size_t text_size,
+    int sol, size_t *match_offset, size_t *match_len, int verbose);
+int regex_iter_init(struct regex_iter *it, struct regex *reg,
+    const char *text0, size_t size0, const char *text1, size_t size1, int sol,
+    size_t from);
+int regex_iter_next(struct regex_iter *it, size_t *match_offset,
+    size_t *match_len, int verbose);
+int regex_exec_split(struct regex *reg, const char *text0, size_t size0,
+    const char *text1, size_t size1, int sol, size_t from, int wrap,
+    size_t *match_offset, size_t *match_len, int verbose);
+int regex_exec_backward(struct regex *reg, const char *text0, size_t size0,
+    const char *text1, size_t size1, int sol, size_t from, int wrap,
+    size_t *match_offset, size_t *match_len, int verbose);
+void set_regex_replace_threads(size_t n);
+int regex_exec_replace_to(struct regex *reg, const char *text,
+    size_t text_size, const char *replace_str, struct obuf *output,
+    int verbose);
+int regex_exec_replace(struct regex *reg, const char *text, size_t text_size,
+    const char *replace_str, char **result, size_t *result_len, int verbose);
+void free_regex_cache(void);
 int regex_search(const char *text, size_t text_size, int sol,
     const char *regex_str, int nl_ins, int case_ins, size_t *match_offset,
     size_t *match_len, int verbose);
+int regex_replace_to(const char *text, size_t text_size,
+    const char *regex_str, int nl_ins, int case_ins, const char *replace_str,
+    struct obuf *output, int verbose);
 int regex_replace(const char *text, size_t text_size, const char *regex_str,
     int nl_ins, int case_ins, const char *replace_str, char **result,
     size_t *result_len, int verbose);
 int get_file_size(const char *fn, size_t *fs);
+int reg_file_check(FILE *stream, int *is_reg);
 int get_path_attr(const char *path, unsigned char *attr);
 int rec_rm(const char *path);
 char *ls_dir(const char *dir);